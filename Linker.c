@@ -7,6 +7,8 @@
  */
 
  #include "Linker.h"
+ #include "immediate.h"
+ #include "rvc.h"
 
 
  #include <stdlib.h>
@@ -14,168 +16,952 @@
  #include <assert.h>
 
 
- struct sLinkedLabel {
-   char *label;
-   uint32_t address;
-   struct sLinkedLabel *next;
- };
-
-
-
  /*
  ----------------------------------
- ---------- LINK PROGRAM ----------
+ ---------- LINK FIXUP ------------
  ----------------------------------
  */
-void link_program(struct sAssembledProgram program, uint8_t *data_segment, uint8_t *text_segment){
+int link_in_range(enum eLinkerCode linker_code, uint32_t address,
+  uint32_t target_address){
+
+  int32_t relative_addr = (int32_t)(target_address - address);
+  switch (linker_code){
+    case LINKER_JAL:
+      return imm_fits(relative_addr, 21, 1);
+    case LINKER_BRANCH:
+      return imm_fits(relative_addr, 13, 1);
+    // auipc+addi reach anywhere
+    default:
+      return 1;
+  }
+} // link_in_range
 
 
-  uint32_t address = DATA_ADDRESS;
-  struct sLinkedLabel *head_label = NULL;
-  struct sLinkedLabel *tail_label = NULL;
+int link_fixup(uint32_t *binary, enum eLinkerCode linker_code, uint32_t address,
+  uint32_t target, uint32_t target_address){
 
-  /*------------ Data-Loop -------------*/
-  for (struct sAssembledData *data_node = program.data; data_node != NULL; data_node = data_node->next){
+  // relative to PC. The field is cleared first, it may have been filled in
+  // before the instruction moved.
+  uint32_t relative_addr = target_address - address;
+  switch (linker_code){
+    case LINKER_JAL:{
+      if (!link_in_range(linker_code, address, target_address)){
+        fprintf(stderr, "Linker error, jump to %s is out of range\n",
+          symtab_name(target));
+        return -1;
+      }
+      *binary &= 0x00000FFF;
+      _bind_imm_j_type(binary, relative_addr);
+      break;
+    }
 
-    // increase address by data length
-    // (only for word and ascii at the moment)
-    address += data_node->data_len;
+    case LINKER_BRANCH:{
+      if (!link_in_range(linker_code, address, target_address)){
+        fprintf(stderr, "Linker error, branch to %s is out of range\n",
+          symtab_name(target));
+        return -1;
+      }
+      *binary &= 0x01FFF07F;
+      _bind_imm_b_type(binary, relative_addr);
+      break;
+    }
 
-    // increase address for align and space
-    uint32_t n = data_node->arg_n;
-    if (data_node->linker_code == LINKER_ALIGN){
-      uint32_t rem = address % (1<<n);
-      if (rem > 0)
-        address += (1<<n) - rem;
+    // the upper 20 bits, rounded up when the addi after it subtracts
+    case LINKER_LA_AUIPC:{
+      *binary &= 0x00000FFF;
+      _bind_imm_u_type(binary, (relative_addr + 0x800) >> 12);
+      break;
     }
-    if (data_node->linker_code == LINKER_SPACE){
-      address += n;
+
+    // the low 12 bits, relative to the auipc before it
+    case LINKER_LA_ADDI:{
+      relative_addr += 4;
+      *binary &= 0x000FFFFF;
+      _bind_imm_i_type(binary, (uint32_t)((int32_t)(relative_addr << 20) >> 20));
+      break;
     }
 
+    default:
+      break;
+  }
+  return 0;
+} // link_fixup
 
-    // load data into data segment if data exists
-    for (int i = 0; i < data_node->data_len; i++){
-      data_segment[address - DATA_ADDRESS + i] = data_node->data[i];
-    }
 
 
-    // if program has a label, add to linkedlabel struct
-    if (data_node->label != NULL){
-      struct sLinkedLabel *linked_label = calloc(1, sizeof(struct sLinkedLabel));
-      assert(linked_label != NULL);
+ /*
+ ----------------------------------
+ ---------- RELAXATION ------------
+ ----------------------------------
+  Branches and jumps are assembled in their short form. One whose target
+  is out of reach is widened, which moves everything after it and may put
+  others out of reach, so this goes on until none is widened. Nothing ever
+  gets shorter, so it stops. Every label operand is a fixup, filled in or
+  not, so they are all filled in again once text has moved.
+  A jal that links jumps through its own rd once widened. A branch or a j
+  past 1 MiB needs a register of its own, and only takes t1 if allowed.
+ */
+
+// Halfwords of each form a branch or jump can take
+#define FORM_RVC (1)        // c.j, c.jal, c.beqz, c.bnez
+#define FORM_SHORT (2)      // jal, or the branch
+#define FORM_JUMP (4)       // auipc+jalr, or the inverted branch over a jal
+#define FORM_FAR (6)        // the inverted branch over auipc+jalr
+
+// Holds the address of a far jump that does not link, as tail does, when
+// the program allows it
+#define REG_T1 (6)
+
+#define OPCODE_AUIPC (0x17)
+#define OPCODE_JALR (0x67)
+#define OPCODE_JAL (0x6F)
+
+// Halfwords the instruction starting with halfword takes
+static uint32_t _size(uint16_t halfword){
+  return RVC_IS_COMPRESSED(halfword) ? 1 : 2;
+}
+
+// Whether a branch or jump in form reaches relative bytes away
+static int _reaches(enum eLinkerCode linker_code, uint32_t form, int32_t relative){
+  int is_jal = linker_code == LINKER_JAL;
+
+  switch (form){
+    case FORM_RVC:
+      return imm_fits(relative, is_jal ? 12 : 9, 1);
+    case FORM_SHORT:
+      return imm_fits(relative, is_jal ? 21 : 13, 1);
+    // the jal is after the inverted branch
+    case FORM_JUMP:
+      return is_jal || imm_fits((int64_t)relative - 4, 21, 1);
+  }
+  return 1;
+}
+
+// Halfword index old of text once the fixups before it have grown, by
+// grown[i] halfwords for those before fixup i
+static uint32_t _moved(const struct sAssembledProgram *program,
+  const uint32_t *grown, uint32_t old){
+
+  size_t lo = 0, hi = program->num_fixups;
+  while (lo < hi){
+    size_t mid = lo + (hi - lo) / 2;
+    if (program->fixups[mid].offset < old)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return old + grown[lo];
+}
+
+// Address of label once text has moved, data does not
+static uint32_t _moved_address(const struct sAssembledProgram *program,
+  const uint32_t *grown, uint32_t label){
+
+  uint32_t address = program_address(program, label);
+  if (address == ADDRESS_UNDEFINED || program->definitions[label].segment != S_TEXT)
+    return address;
+  return program->text_address +
+    _moved(program, grown, program->definitions[label].text_len) * 2;
+}
+
+// Stores a 32-bit instruction as two halfwords, low half first
+static void _put(uint16_t *halves, uint32_t binary){
+  halves[0] = (uint16_t)binary;
+  halves[1] = (uint16_t)(binary >> 16);
+}
+
+// Writes fixup in form at halves, from its instruction binary, and adds
+// the fixups of what it became. Nothing is filled in yet.
+static void _widen(uint16_t *halves, const struct sFixup *fixup, uint32_t binary,
+  uint32_t form, struct sFixup *fixups, size_t *num_fixups){
+
+  uint32_t offset = (uint32_t)(fixup->offset), rd = (binary >> 7) & 0x1F;
+  uint32_t base = rd != 0 ? rd : REG_T1;
+
+  if (form == FORM_SHORT){
+    _put(halves, binary);
+    fixups[(*num_fixups)++] = *fixup;
+    return;
+  }
 
-      linked_label->label = data_node->label;
-      linked_label->address = address;
+  // the inverted branch skips the jump, which takes its place
+  if (fixup->linker_code == LINKER_BRANCH){
+    uint32_t inverted = (binary & 0x01FFF07F) ^ 0x00001000;
+    _bind_imm_b_type(&inverted, form * 2);
+    _put(halves, inverted);
+    halves += 2;
+    offset += 2;
+    rd = 0;
+    base = REG_T1;
+    form -= 2;
+  }
 
-      if (head_label == NULL)
-        head_label = linked_label;
-      if (tail_label != NULL)
-        tail_label->next = linked_label;
-      tail_label = linked_label;
+  if (form == FORM_SHORT){
+    _put(halves, OPCODE_JAL);
+    fixups[(*num_fixups)++] = (struct sFixup){.offset = offset,
+      .target = fixup->target, .linker_code = LINKER_JAL};
+  } else {
+    // auipc and jalr are filled in like la's auipc and addi
+    _put(halves, base << 7 | OPCODE_AUIPC);
+    _put(halves + 2, base << 15 | rd << 7 | OPCODE_JALR);
+    fixups[(*num_fixups)++] = (struct sFixup){.offset = offset,
+      .target = fixup->target, .linker_code = LINKER_LA_AUIPC};
+    fixups[(*num_fixups)++] = (struct sFixup){.offset = offset + 2,
+      .target = fixup->target, .linker_code = LINKER_LA_ADDI};
+  }
+}
+
+// Rebuilds text with every fixup in its form, and moves the labels
+static void _rewrite(struct sAssembledProgram *program, const uint8_t *forms,
+  const uint32_t *grown){
+
+  size_t n = program->num_fixups, num_fixups = 0, from = 0;
+  size_t text_len = program->text_len + grown[n];
+  uint16_t *text = malloc(text_len * sizeof(uint16_t));
+  // a far branch becomes three instructions, two of them fixups
+  struct sFixup *fixups = malloc(2 * n * sizeof(struct sFixup));
+  assert(text != NULL && fixups != NULL);
+
+  for (size_t i = 0; i < n; i++){
+    struct sFixup fixup = program->fixups[i];
+    uint16_t *halves = &program->text[fixup.offset];
+    uint32_t size = _size(halves[0]);
+
+    memcpy(text + from + grown[i], program->text + from,
+      (fixup.offset - from) * sizeof(uint16_t));
+    from = fixup.offset + size;
+    fixup.offset += grown[i];
+
+    if (forms[i] == size){
+      memcpy(text + fixup.offset, halves, size * sizeof(uint16_t));
+      fixups[num_fixups++] = fixup;
+    } else {
+      uint32_t binary = size == 1 ? rvc_expand(halves[0])
+        : halves[0] | (uint32_t)halves[1] << 16;
+      _widen(text + fixup.offset, &fixup, binary, forms[i], fixups, &num_fixups);
     }
+  }
+  memcpy(text + from + grown[n], program->text + from,
+    (program->text_len - from) * sizeof(uint16_t));
+
+  for (size_t i = 0; i < program->num_text_labels; i++)
+    program->text_labels[i].offset =
+      _moved(program, grown, program->text_labels[i].offset / 2) * 2;
+  for (size_t label = 0; label < program->num_definitions; label++){
+    struct sDefinition *definition = &program->definitions[label];
+    if (definition->address == ADDRESS_UNDEFINED || definition->segment != S_TEXT)
+      continue;
+    definition->text_len = _moved(program, grown, definition->text_len);
+    definition->address = program->text_address + definition->text_len * 2;
+  }
 
-  } // data loop
+  free(program->text);
+  free(program->fixups);
+  program->text = text;
+  program->text_len = program->text_cap = text_len;
+  program->fixups = fixups;
+  program->num_fixups = num_fixups;
+  program->cap_fixups = 2 * n;
+}
+
+// Widest form the branch or jump at halves can take, without t1 unless
+// clobber_t1
+static uint32_t _widest(const uint16_t *halves, enum eLinkerCode linker_code,
+  int clobber_t1){
+
+  uint32_t binary = _size(halves[0]) == 1 ? rvc_expand(halves[0])
+    : halves[0] | (uint32_t)halves[1] << 16;
+
+  if (linker_code == LINKER_BRANCH)
+    return clobber_t1 ? FORM_FAR : FORM_JUMP;
+  return clobber_t1 || ((binary >> 7) & 0x1F) != 0 ? FORM_JUMP : FORM_SHORT;
+}
+
+// Widens every branch and jump that does not reach, up to its widest form.
+// Returns 1 if text moved, 0 if not, or -1 if one does not reach even so.
+static int _relax(struct sAssembledProgram *program, int clobber_t1){
+  size_t n = program->num_fixups;
+  uint8_t *forms = malloc(n + 1);
+  uint8_t *widest = malloc(n + 1);
+  uint32_t *grown = malloc((n + 1) * sizeof(uint32_t));
+  int changed, moved = 0, status = 0;
+  assert(forms != NULL && widest != NULL && grown != NULL);
+
+  for (size_t i = 0; i < n; i++){
+    const struct sFixup *fixup = &program->fixups[i];
+    forms[i] = (uint8_t)_size(program->text[fixup->offset]);
+    widest[i] = (uint8_t)_widest(&program->text[fixup->offset], fixup->linker_code,
+      clobber_t1);
+  }
 
-  address = TEXT_ADDRESS;
-  /*------------ Text-Loop -------------*/
-  for (struct sAssembledInstruction *text_node = program.text; text_node != NULL; text_node = text_node->next){
+  do {
+    changed = 0;
+    grown[0] = 0;
+    for (size_t i = 0; i < n; i++)
+      grown[i + 1] = grown[i] + forms[i] - _size(program->text[program->fixups[i].offset]);
+
+    for (size_t i = 0; i < n; i++){
+      const struct sFixup *fixup = &program->fixups[i];
+      uint32_t target_address = _moved_address(program, grown, fixup->target);
+      uint32_t address = program->text_address + (fixup->offset + grown[i]) * 2;
+
+      if ((fixup->linker_code != LINKER_JAL && fixup->linker_code != LINKER_BRANCH) ||
+          target_address == ADDRESS_UNDEFINED)
+        continue;
+      while (forms[i] < widest[i] &&
+          !_reaches(fixup->linker_code, forms[i], (int32_t)(target_address - address))){
+        forms[i] = forms[i] == FORM_RVC ? FORM_SHORT : forms[i] + 2;
+        changed = moved = 1;
+      }
+    }
+  } while (changed);
+
+  // Those at their widest that still do not reach
+  for (size_t i = 0; i < n; i++){
+    const struct sFixup *fixup = &program->fixups[i];
+    uint32_t target_address = _moved_address(program, grown, fixup->target);
+    uint32_t address = program->text_address + (fixup->offset + grown[i]) * 2;
+
+    if ((fixup->linker_code != LINKER_JAL && fixup->linker_code != LINKER_BRANCH) ||
+        target_address == ADDRESS_UNDEFINED ||
+        _reaches(fixup->linker_code, forms[i], (int32_t)(target_address - address)))
+      continue;
+    fprintf(stderr, "Linker error, %s to %s is out of range without t1, "
+      "see --clobber-t1\n", fixup->linker_code == LINKER_JAL ? "jump" : "branch",
+      symtab_name(fixup->target));
+    status = -1;
+  }
 
-    // Always a constant.
-    address += 4;
+  if (moved && status == 0)
+    _rewrite(program, forms, grown);
+  free(forms);
+  free(widest);
+  free(grown);
+  return status != 0 ? status : moved;
+}
 
-    // if program has a label, add to linkedlabel struct
-    if (text_node->label != NULL){
-      struct sLinkedLabel *linked_label = calloc(1, sizeof(struct sLinkedLabel));
-      assert(linked_label != NULL);
 
-      linked_label->label = text_node->label;
-      linked_label->address = address;
+ /*
+ ----------------------------------
+ ----------- LINK MERGE -----------
+ ----------------------------------
+  Objects are put together one after the other. A unit is laid out as if
+  it started at the start of each segment, so everything in it moves by
+  the length of what is before it. Instructions that were filled in are
+  filled in again, only those within text would still be right.
+ */
 
-      if (head_label == NULL)
-        head_label = linked_label;
-      if (tail_label != NULL)
-        tail_label->next = linked_label;
-      tail_label = linked_label;
-    }
+// Appends num elements of size at from to array, which holds len of them
+static void *_append(void *array, size_t *len, size_t *cap, const void *from,
+  size_t num, size_t size){
+
+  if (num == 0)
+    return array;
+  if (*len + num > *cap){
+    size_t new_cap = *cap ? *cap : 64;
+    while (new_cap < *len + num)
+      new_cap *= 2;
+    array = realloc(array, new_cap * size);
+    assert(array != NULL);
+    *cap = new_cap;
+  }
+  memcpy((uint8_t *)array + *len * size, from, num * size);
+  *len += num;
+  return array;
+}
 
-  } // text loop
+// Defines label at address in program, unless it is already
+static int _merge_label(struct sAssembledProgram *program, uint32_t label,
+  enum eAssemblerState segment, uint32_t address, uint32_t text_len){
 
-  address = TEXT_ADDRESS;
-  /*------------ Last-Loop -------------*/
-  for (struct sAssembledInstruction *text_node = program.text; text_node != NULL; text_node = text_node->next){
-    // Always a constant.
+  struct sDefinition *definition = &program->definitions[label];
 
-    // link labels to targets (for j and b instructions)
-    if (text_node->target_label != NULL){
-      uint32_t target_address;
+  if (definition->address != ADDRESS_UNDEFINED){
+    fprintf(stderr, "Linker error, label defined twice: %s\n", symtab_name(label));
+    return -1;
+  }
+  *definition = (struct sDefinition){.address = address, .text_len = text_len,
+    .segment = segment};
+  return 0;
+}
+
+int link_merge(struct sAssembledProgram *program, struct sAssembledProgram *unit){
+  static const uint16_t c_nop = 0x0001;
+  static const uint8_t zero = 0;
+  uint32_t align = unit->data_align > 4 ? unit->data_align : 4;
+  size_t text_base, data_base, count = symtab_count();
+  int status = 0;
+
+  // Only compressed text ends on a halfword, the next instruction needs a
+  // word if the unit is not compressed
+  if (program->text_len % 2 != 0)
+    program->text = _append(program->text, &program->text_len, &program->text_cap,
+      &c_nop, 1, sizeof(uint16_t));
+  while (program->data_len % align != 0)
+    program->data = _append(program->data, &program->data_len, &program->data_cap,
+      &zero, 1, 1);
+  if (unit->data_align > program->data_align)
+    program->data_align = unit->data_align;
+  text_base = program->text_len;
+  data_base = program->data_len;
+
+  program->text = _append(program->text, &program->text_len, &program->text_cap,
+    unit->text, unit->text_len, sizeof(uint16_t));
+  program->data = _append(program->data, &program->data_len, &program->data_cap,
+    unit->data, unit->data_len, 1);
+
+  if (program->num_definitions < count){
+    program->definitions = realloc(program->definitions, count * sizeof(struct sDefinition));
+    assert(program->definitions != NULL);
+    memset(program->definitions + program->num_definitions, 0xFF,
+      (count - program->num_definitions) * sizeof(struct sDefinition));
+    program->num_definitions = count;
+  }
 
-      for (struct sLinkedLabel *label_node = head_label; label_node != NULL; label_node = label_node->next){
-        if (!strcmp(label_node->label, text_node->target_label)){
-          target_address = label_node->address;
-          break;
-        }
-      } // 2nd loop
+  for (size_t i = 0; i < unit->num_text_labels; i++){
+    struct sLabel label = unit->text_labels[i];
+    label.offset += (uint32_t)text_base * 2;
+    if (_merge_label(program, label.label, S_TEXT, program->text_address + label.offset,
+        label.offset / 2) != 0)
+      status = -1;
+    program->text_labels = _append(program->text_labels, &program->num_text_labels,
+      &program->cap_text_labels, &label, 1, sizeof(struct sLabel));
+  }
+  for (size_t i = 0; i < unit->num_data_labels; i++){
+    struct sLabel label = unit->data_labels[i];
+    label.offset += (uint32_t)data_base;
+    if (_merge_label(program, label.label, S_DATA, program->data_address + label.offset,
+        0) != 0)
+      status = -1;
+    program->data_labels = _append(program->data_labels, &program->num_data_labels,
+      &program->cap_data_labels, &label, 1, sizeof(struct sLabel));
+  }
+  for (size_t i = 0; i < unit->num_fixups; i++){
+    struct sFixup fixup = unit->fixups[i];
+    fixup.offset += (uint32_t)text_base;
+    fixup.resolved = 0;
+    program->fixups = _append(program->fixups, &program->num_fixups,
+      &program->cap_fixups, &fixup, 1, sizeof(struct sFixup));
+  }
 
+  program_free(unit);
+  return status;
+} // link_merge
 
-      // relative to PC
-      uint32_t relative_addr = target_address - address;
-      switch (text_node->linker_code){
-        case LINKER_JAL:{
-          _bind_imm_j_type(&text_node->binary, relative_addr);
-          break;
-        }
 
-        case LINKER_BRANCH:{
-          _bind_imm_b_type(&text_node->binary, relative_addr);
-          break;
-        }
+ /*
+ ----------------------------------
+ ------------ LINK GC -------------
+ ----------------------------------
+  A section runs from a label to the next one in its segment, text in
+  halfwords and data in bytes. Fixups are the edges between them, and a
+  text section that does not end in a jump also reaches the one after it.
+  Sections nothing reaches are dropped, and the rest close up in order.
+  Everything moves, so every fixup is filled in again.
+ */
+
+// A run of a segment from one label to the next
+struct sSection {
+  uint32_t start, end;        // in halfwords of text, or bytes of data
+  uint32_t moved_to;          // start once the dead sections are dropped
+  size_t first_fixup;         // first fixup at or after start, in text
+  int live;
+};
+
+// Adds the sections of a segment of len, split at the offsets of labels,
+// to sections. shift turns a label offset into the unit of len.
+static size_t _split(struct sSection *sections, size_t num_sections,
+  const struct sLabel *labels, size_t num_labels, uint32_t shift, size_t len){
+
+  uint32_t start = 0;
+  for (size_t i = 0; i < num_labels; i++){
+    uint32_t offset = labels[i].offset >> shift;
+    if (offset == start)
+      continue;
+    sections[num_sections++] = (struct sSection){.start = start, .end = offset};
+    start = offset;
+  }
+  sections[num_sections++] = (struct sSection){.start = start, .end = (uint32_t)len};
+  return num_sections;
+}
+
+// Index of the section of num from first that holds offset
+static size_t _section_of(const struct sSection *sections, size_t first,
+  size_t num, uint32_t offset){
+
+  size_t lo = first, hi = first + num;
+  while (hi - lo > 1){
+    size_t mid = lo + (hi - lo) / 2;
+    if (sections[mid].start <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Whether the last instruction of the text from start to end is a jump
+// that does not come back, j, jr or ret. Sizes are only known going forward.
+static int _ends_in_jump(const uint16_t *text, uint32_t start, uint32_t end){
+  uint32_t last = end, binary;
+
+  for (uint32_t i = start; i < end; i += _size(text[i]))
+    last = i;
+  if (last == end)
+    return 0;
+
+  // c.j, or c.jr with its rs1
+  if (_size(text[last]) == 1)
+    return (text[last] & 0xE003) == 0xA001 ||
+      ((text[last] & 0xF07F) == 0x8002 && (text[last] & 0x0F80) != 0);
+  binary = text[last] | (uint32_t)text[last + 1] << 16;
+  return ((binary & 0x7F) == OPCODE_JAL || (binary & 0x7F) == OPCODE_JALR) &&
+    ((binary >> 7) & 0x1F) == 0;
+}
+
+// Keeps the labels of live sections, moved with them, and forgets the others
+static void _sweep_labels(struct sAssembledProgram *program, struct sLabel *labels,
+  size_t *num_labels, const struct sSection *sections, size_t first, size_t num,
+  uint32_t shift){
+
+  size_t kept = 0;
+  for (size_t i = 0; i < *num_labels; i++){
+    struct sLabel label = labels[i];
+    struct sDefinition *definition = &program->definitions[label.label];
+    const struct sSection *section =
+      &sections[_section_of(sections, first, num, label.offset >> shift)];
+
+    if (!section->live){
+      memset(definition, 0xFF, sizeof(struct sDefinition));
+      continue;
+    }
+    label.offset += (section->moved_to - section->start) << shift;
+    if (definition->segment == S_TEXT){
+      definition->address = program->text_address + label.offset;
+      definition->text_len = label.offset / 2;
+    } else {
+      definition->address = program->data_address + label.offset;
+    }
+    labels[kept++] = label;
+  }
+  *num_labels = kept;
+}
+
+void link_gc(struct sAssembledProgram *program, uint32_t entry){
+  size_t max = program->num_text_labels + program->num_data_labels + 2;
+  struct sSection *sections = malloc(max * sizeof(struct sSection));
+  size_t *stack = malloc(max * sizeof(size_t));
+  size_t num_text, num, depth = 0, num_fixups = 0, text_len = 0, data_len = 0;
+  uint32_t align = program->data_align > 4 ? program->data_align : 4;
+  uint16_t *text;
+  uint8_t *data;
+  assert(sections != NULL && stack != NULL);
+
+  num_text = _split(sections, 0, program->text_labels, program->num_text_labels,
+    1, program->text_len);
+  num = _split(sections, num_text, program->data_labels, program->num_data_labels,
+    0, program->data_len);
+  for (size_t s = 0, i = 0; s < num_text; s++){
+    while (i < program->num_fixups && program->fixups[i].offset < sections[s].start)
+      i++;
+    sections[s].first_fixup = i;
+  }
 
-        case LINKER_LA_AUIPC:{
-          _bind_imm_u_type(&text_node->binary, relative_addr >> 12);
-          break;
-        }
+  /*------------ Mark -------------*/
+  // Text runs from its start, which is kept even if entry is elsewhere.
+  // Data before the first label can only be reached by its address.
+  sections[0].live = 1;
+  stack[depth++] = 0;
+  if (program->num_data_labels == 0 || program->data_labels[0].offset > 0){
+    sections[num_text].live = 1;
+    stack[depth++] = num_text;
+  }
+  if (program_address(program, entry) != ADDRESS_UNDEFINED){
+    const struct sDefinition *definition = &program->definitions[entry];
+    size_t s = definition->segment == S_TEXT
+      ? _section_of(sections, 0, num_text, definition->text_len)
+      : _section_of(sections, num_text, num - num_text,
+        definition->address - program->data_address);
+    if (!sections[s].live){
+      sections[s].live = 1;
+      stack[depth++] = s;
+    }
+  }
 
-        case LINKER_LA_ADDI:{
-          _bind_imm_i_type(&text_node->binary, relative_addr);
-          break;
-        }
+  while (depth > 0){
+    size_t s = stack[--depth];
+    const struct sSection *section = &sections[s];
+
+    if (s >= num_text)
+      continue;
+    // what it refers to, defined or left for link_program() to report
+    for (size_t i = section->first_fixup; i < program->num_fixups &&
+        program->fixups[i].offset < section->end; i++){
+      uint32_t target = program->fixups[i].target;
+      const struct sDefinition *definition = &program->definitions[target];
+      size_t t;
+
+      if (program_address(program, target) == ADDRESS_UNDEFINED)
+        continue;
+      t = definition->segment == S_TEXT
+        ? _section_of(sections, 0, num_text, definition->text_len)
+        : _section_of(sections, num_text, num - num_text,
+          definition->address - program->data_address);
+      if (!sections[t].live){
+        sections[t].live = 1;
+        stack[depth++] = t;
+      }
+    }
+    if (s + 1 < num_text && !sections[s + 1].live &&
+        !_ends_in_jump(program->text, section->start, section->end)){
+      sections[s + 1].live = 1;
+      stack[depth++] = s + 1;
+    }
+  }
 
-        default:
-          break;
+  /*------------ Sweep -------------*/
+  // Data keeps its offset modulo the alignment, so whatever was aligned
+  // in it still is
+  text = malloc(program->text_len * sizeof(uint16_t) + 1);
+  data = malloc(program->data_len + 1);
+  assert(text != NULL && data != NULL);
+  for (size_t s = 0; s < num; s++){
+    struct sSection *section = &sections[s];
+    uint32_t len = section->end - section->start;
+
+    if (!section->live)
+      continue;
+    if (s < num_text){
+      section->moved_to = (uint32_t)text_len;
+      if (len > 0)
+        memcpy(text + text_len, program->text + section->start, len * sizeof(uint16_t));
+      text_len += len;
+      for (size_t i = section->first_fixup; i < program->num_fixups &&
+          program->fixups[i].offset < section->end; i++){
+        struct sFixup fixup = program->fixups[i];
+        fixup.offset += section->moved_to - section->start;
+        fixup.resolved = 0;
+        program->fixups[num_fixups++] = fixup;
       }
-    } //if
+    } else {
+      size_t pad = (section->start % align + align - data_len % align) % align;
+      memset(data + data_len, 0, pad);
+      data_len += pad;
+      section->moved_to = (uint32_t)data_len;
+      if (len > 0)
+        memcpy(data + data_len, program->data + section->start, len);
+      data_len += len;
+    }
+  }
 
-    // load data into data segment if data exists
+  _sweep_labels(program, program->text_labels, &program->num_text_labels,
+    sections, 0, num_text, 1);
+  _sweep_labels(program, program->data_labels, &program->num_data_labels,
+    sections, num_text, num - num_text, 0);
 
+  free(program->text);
+  free(program->data);
+  program->text = text;
+  program->text_len = text_len;
+  program->text_cap = program->text_len;
+  program->data = data;
+  program->data_len = data_len;
+  program->data_cap = program->data_len;
+  program->num_fixups = num_fixups;
 
-    text_segment[address - TEXT_ADDRESS] = (uint8_t)(text_node->binary);
-    text_segment[address - TEXT_ADDRESS + 1] = (uint8_t)(text_node->binary >> 8);
-    text_segment[address - TEXT_ADDRESS + 2] = (uint8_t)(text_node->binary >> 16);
-    text_segment[address - TEXT_ADDRESS + 3] = (uint8_t)(text_node->binary >> 24);
+  free(sections);
+  free(stack);
+} // link_gc
 
 
-    // Always a constant.
-    address += 4;
+ /*
+ ----------------------------------
+ -------- LINK MERGE DATA ---------
+ ----------------------------------
+  Data is split into sections at its labels, as for link_gc(). Sections
+  with the same bytes, at the same offset modulo the alignment, are kept
+  once. A section that is just a NUL-terminated string is kept as the end
+  of a string it ends, or of an equal one, wherever it is. Sorted by their
+  bytes reversed, a string comes right after the longest one it ends, or
+  right after one merged into it.
+ */
 
-  } // last loop
+// A data section, or the string it holds
+struct sBlob {
+  const uint8_t *bytes;
+  uint32_t len;
+  uint32_t residue;           // of its offset, modulo the alignment
+  uint32_t section;
+};
+
+// Orders blobs by length, residue and then bytes, the first of each run of
+// equal ones first
+static int _compare_blobs(const void *a, const void *b){
+  const struct sBlob *x = a, *y = b;
+  int order;
+
+  if (x->len != y->len)
+    return x->len < y->len ? -1 : 1;
+  if (x->residue != y->residue)
+    return x->residue < y->residue ? -1 : 1;
+  order = memcmp(x->bytes, y->bytes, x->len);
+  if (order != 0)
+    return order;
+  return x->section < y->section ? -1 : x->section > y->section;
+}
+
+// Orders strings by their bytes from the last one back, longest first when
+// one ends the other, and the first of equal ones first
+static int _compare_tails(const void *a, const void *b){
+  const struct sBlob *x = a, *y = b;
+  uint32_t len = x->len < y->len ? x->len : y->len;
+
+  for (uint32_t i = 1; i <= len; i++){
+    if (x->bytes[x->len - i] != y->bytes[y->len - i])
+      return x->bytes[x->len - i] < y->bytes[y->len - i] ? 1 : -1;
+  }
+  if (x->len != y->len)
+    return x->len > y->len ? -1 : 1;
+  return x->section < y->section ? -1 : x->section > y->section;
+}
+
+// A label and where it was listed before merging
+struct sMoved {
+  struct sLabel label;
+  uint32_t index;
+};
+
+// Orders labels by offset, and those at the same offset as they were listed.
+// Not by symbol ID, under -j those depend on which thread interned them first.
+static int _compare_moved(const void *a, const void *b){
+  const struct sMoved *x = a, *y = b;
+
+  if (x->label.offset != y->label.offset)
+    return x->label.offset < y->label.offset ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Whether section is a string, with its NUL as its last byte and only there.
+// One followed by alignment is not, its zeros cannot be told from a word.
+static int _is_string(const uint8_t *data, const struct sSection *section){
+  uint32_t len = section->end - section->start;
+  return len > 0 && memchr(data + section->start, 0, len) == data + section->end - 1;
+}
+
+// Whether section holds nothing but zeros, or nothing at all
+static int _is_zero(const uint8_t *data, const struct sSection *section){
+  for (uint32_t i = section->start; i < section->end; i++){
+    if (data[i] != 0)
+      return 0;
+  }
+  return 1;
+}
+
+void link_merge_data(struct sAssembledProgram *program){
+  size_t max = program->num_data_labels + 1;
+  struct sSection *sections = malloc(max * sizeof(struct sSection));
+  struct sBlob *blobs = malloc(max * sizeof(struct sBlob));
+  uint32_t *host = malloc(max * sizeof(uint32_t));
+  uint32_t *delta = malloc(max * sizeof(uint32_t));
+  uint32_t align = program->data_align > 4 ? program->data_align : 4;
+  size_t num, num_blobs = 0, data_len = 0;
+  // data before the first label is never merged, nothing names it
+  int named = program->num_data_labels > 0 && program->data_labels[0].offset == 0;
+  uint8_t *data;
+  assert(sections != NULL && blobs != NULL && host != NULL && delta != NULL);
+
+  num = _split(sections, 0, program->data_labels, program->num_data_labels, 0,
+    program->data_len);
+  for (size_t s = 0; s < num; s++){
+    host[s] = (uint32_t)s;
+    delta[s] = 0;
+  }
 
-  struct sLinkedLabel *next = head_label;
-  while (next != NULL){
-    next = head_label->next;
-    free(head_label);
-    head_label = next;
+  /*------------ Equal bytes -------------*/
+  // Zeros are left alone, they are most likely .space to be written to.
+  // Strings are merged with their tails.
+  for (size_t s = 0; s < num; s++){
+    const struct sSection *section = &sections[s];
+    if (_is_zero(program->data, section) || _is_string(program->data, section) ||
+        (s == 0 && !named))
+      continue;
+    blobs[num_blobs++] = (struct sBlob){.bytes = program->data + section->start,
+      .len = section->end - section->start, .residue = section->start % align,
+      .section = (uint32_t)s};
+  }
+  if (num_blobs > 0)
+    qsort(blobs, num_blobs, sizeof(struct sBlob), _compare_blobs);
+  for (size_t i = 1; i < num_blobs; i++){
+    const struct sBlob *first = &blobs[i - 1];
+    if (blobs[i].len == first->len && blobs[i].residue == first->residue &&
+        memcmp(blobs[i].bytes, first->bytes, first->len) == 0)
+      host[blobs[i].section] = host[first->section];
   }
 
-} // link_program
+  /*------------ String tails -------------*/
+  {
+    size_t num_strings = 0;
+    for (size_t s = 0; s < num; s++){
+      const struct sSection *section = &sections[s];
+      if ((s > 0 || named) && _is_string(program->data, section))
+        blobs[num_strings++] = (struct sBlob){.bytes = program->data + section->start,
+          .len = section->end - section->start, .section = (uint32_t)s};
+    }
+    if (num_strings > 0)
+      qsort(blobs, num_strings, sizeof(struct sBlob), _compare_tails);
+    for (size_t i = 1; i < num_strings; i++){
+      const struct sBlob *longer = &blobs[i - 1];
+      const struct sBlob *string = &blobs[i];
+      uint32_t s = string->section;
+
+      if (memcmp(longer->bytes + longer->len - string->len, string->bytes,
+          string->len) != 0)
+        continue;
+      host[s] = host[longer->section];
+      delta[s] = delta[longer->section] + longer->len - string->len;
+    }
+  }
 
+  /*------------ Layout -------------*/
+  // as link_gc() does, the kept sections close up in order
+  data = malloc(program->data_len + 1);
+  assert(data != NULL);
+  for (size_t s = 0; s < num; s++){
+    struct sSection *section = &sections[s];
+    uint32_t len = section->end - section->start;
+    size_t pad = (section->start % align + align - data_len % align) % align;
+
+    if (host[s] != s)
+      continue;
+    memset(data + data_len, 0, pad);
+    data_len += pad;
+    section->moved_to = (uint32_t)data_len;
+    if (len > 0)
+      memcpy(data + data_len, program->data + section->start, len);
+    data_len += len;
+  }
+
+  // A label moves with its section, or into the one it was merged into,
+  // which may itself have been merged
+  for (size_t i = 0; i < program->num_data_labels; i++){
+    struct sLabel *label = &program->data_labels[i];
+    size_t s = _section_of(sections, 0, num, label->offset);
+    uint32_t offset = label->offset - sections[s].start;
 
+    while (host[s] != s){
+      offset += delta[s];
+      s = host[s];
+    }
+    label->offset = sections[s].moved_to + offset;
+    program->definitions[label->label].address = program->data_address + label->offset;
+  }
+  if (program->num_data_labels > 0){
+    struct sMoved *moved = malloc(program->num_data_labels * sizeof(struct sMoved));
+    assert(moved != NULL);
+    for (size_t i = 0; i < program->num_data_labels; i++)
+      moved[i] = (struct sMoved){.label = program->data_labels[i], .index = (uint32_t)i};
+    qsort(moved, program->num_data_labels, sizeof(struct sMoved), _compare_moved);
+    for (size_t i = 0; i < program->num_data_labels; i++)
+      program->data_labels[i] = moved[i].label;
+    free(moved);
+  }
+  for (size_t i = 0; i < program->num_fixups; i++)
+    program->fixups[i].resolved = 0;
 
+  free(program->data);
+  program->data = data;
+  program->data_len = program->data_cap = data_len;
 
-/*
-//-------Break word into 4 bytes-------
-// little indian following risc-v arch
-assembled_instruction->bytes[0] = (uint8_t)(assembled_instruction->binary >> 0);
-assembled_instruction->bytes[1] = (uint8_t)(assembled_instruction->binary >> 8);
-assembled_instruction->bytes[2] = (uint8_t)(assembled_instruction->binary >> 16);
-assembled_instruction->bytes[3] = (uint8_t)(assembled_instruction->binary >> 24);
-*/
+  free(sections);
+  free(blobs);
+  free(host);
+  free(delta);
+} // link_merge_data
+
+
+ /*
+ ----------------------------------
+ ---------- LINK PROGRAM ----------
+ ----------------------------------
+ */
+int link_program(struct sAssembledProgram *program, size_t text_limit,
+  size_t data_limit, int clobber_t1, uint8_t **text_segment){
+
+  int status = 0;
+  int moved = _relax(program, clobber_t1);
+  size_t text_bytes = program->text_len * 2;
+  uint64_t text_end = (uint64_t)program->text_address + text_bytes;
+  uint64_t data_end = (uint64_t)program->data_address + program->data_len;
+
+  *text_segment = NULL;
+  if (moved < 0)
+    return -1;
+
+  /*------------ Layout -------------*/
+  // each segment within its limit, and in memory on its own
+  if (text_bytes > text_limit){
+    fprintf(stderr, "Linker error, text is %zu bytes, over its limit of %zu\n",
+      text_bytes, text_limit);
+    return -1;
+  }
+  if (program->data_len > data_limit){
+    fprintf(stderr, "Linker error, data is %zu bytes, over its limit of %zu\n",
+      program->data_len, data_limit);
+    return -1;
+  }
+  if (text_end > (uint64_t)1 << 32 || data_end > (uint64_t)1 << 32){
+    fprintf(stderr, "Linker error, %s at 0x%08x runs past the end of memory\n",
+      text_end > (uint64_t)1 << 32 ? "text" : "data",
+      text_end > (uint64_t)1 << 32 ? program->text_address : program->data_address);
+    return -1;
+  }
+  if (text_bytes > 0 && program->data_len > 0 &&
+      program->text_address < data_end && program->data_address < text_end){
+    fprintf(stderr, "Linker error, text at 0x%08x and data at 0x%08x overlap\n",
+      program->text_address, program->data_address);
+    return -1;
+  }
+
+  /*------------ Backpatch-Loop -------------*/
+  // Every label is defined by now. Backward references were filled in as
+  // they were assembled, only forward ones are left unless text moved.
+  for (size_t i = 0; i < program->num_fixups; i++){
+    const struct sFixup *fixup = &program->fixups[i];
+    uint32_t target_address = program_address(program, fixup->target);
+
+    if (fixup->resolved && !moved)
+      continue;
+    if (target_address == ADDRESS_UNDEFINED){
+      fprintf(stderr, "Linker error, undefined label %s\n",
+        symtab_name(fixup->target));
+      status = -1;
+      continue;
+    }
+    // Only branches and jumps are compressed, and kept so if they reach
+    uint16_t *halves = &program->text[fixup->offset];
+    uint32_t binary = _size(halves[0]) == 1 ? rvc_expand(halves[0])
+      : halves[0] | (uint32_t)halves[1] << 16;
+    if (link_fixup(&binary, fixup->linker_code, program->text_address + fixup->offset * 2,
+        fixup->target, target_address) != 0)
+      status = -1;
+    if (_size(halves[0]) == 1){
+      halves[0] = rvc_compress(binary);
+      assert(halves[0] != 0);
+    } else {
+      _put(halves, binary);
+    }
+  } // backpatch loop
+  if (status != 0)
+    return status;
+
+  /*------------ Text-Segment -------------*/
+  // text is stored little endian, a byte at a time. Data is stored as it is.
+  *text_segment = malloc(text_bytes + 1);
+  assert(*text_segment != NULL);
+  for (size_t i = 0; i < program->text_len; i++){
+    (*text_segment)[i * 2] = (uint8_t)(program->text[i]);
+    (*text_segment)[i * 2 + 1] = (uint8_t)(program->text[i] >> 8);
+  }
+
+  return 0;
+} // link_program
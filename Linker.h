@@ -14,26 +14,56 @@
 #include "parser.h"
 #include "RISCV_32I_Assembler.h"
 
+// Where the segments are loaded, unless the assembler is told otherwise
 #define DATA_ADDRESS 0x10000000
 #define TEXT_ADDRESS 0x00400000
 
-
-
-void link_program(struct sAssembledProgram program, uint8_t *data_segment, uint8_t *text_segment);
-
-
-
-
-
-
-//accepts text & data segments
-// assembled program
-
-
-
-
-
-
-
+// Largest the segments may be by default, text up to the data and data up
+// to the stack at the top of user memory
+#define TEXT_LIMIT (DATA_ADDRESS - TEXT_ADDRESS)
+#define DATA_LIMIT (0x7FFFF000 - DATA_ADDRESS)
+
+// Returns 1 if the instruction at address reaches target_address in the
+// form it is assembled in, a branch or jal that does not is relaxed
+int link_in_range(enum eLinkerCode linker_code, uint32_t address,
+  uint32_t target_address);
+
+// Fills in the label operand of the instruction at address in binary, for a
+// target at target_address, over whatever was filled in before.
+// Returns 0, or -1 if it cannot reach it.
+int link_fixup(uint32_t *binary, enum eLinkerCode linker_code, uint32_t address,
+  uint32_t target, uint32_t target_address);
+
+// Appends unit to program, as if it had been assembled after it, and
+// releases it. Its data starts aligned as it was in its own segment, and
+// all of its fixups are left to be filled in. Returns 0, or -1 if it
+// defines a label program already has.
+int link_merge(struct sAssembledProgram *program, struct sAssembledProgram *unit);
+
+// Drops the code and data that nothing reaches from the start of text or
+// entry, before anything is laid out. A section runs from a label to the
+// next, and is reached by the fixups of those reached, or by falling
+// through from the one before it. Code or data only ever used by its
+// address, not by a label, is dropped as well.
+void link_gc(struct sAssembledProgram *program, uint32_t entry);
+
+// Keeps data with the same bytes once, and a NUL-terminated string that
+// ends another as the end of it, with their labels pointing into the copy
+// that is kept. Data that is nothing but zeros is left alone. The program
+// must not write to the rest, as labels may now share it.
+void link_merge_data(struct sAssembledProgram *program);
+
+// Widens the branches and jumps in program that do not reach their target,
+// and fills in the forward references. text_segment is set to the text laid
+// out little endian, text_len * 2 bytes released with free(). The data
+// segment is program->data as it is.
+// A jal that links is widened to auipc+jalr through its rd, and a branch
+// to the inverted branch over a jal, which reach 4 GiB and 1 MiB. A branch
+// or j further than 1 MiB is an error, unless clobber_t1: it then jumps
+// through t1 as tail does, and whatever t1 held is lost.
+// Returns 0, or -1 if a label is undefined or out of range, a segment is
+// larger than its limit in bytes or the segments overlap
+int link_program(struct sAssembledProgram *program, size_t text_limit,
+  size_t data_limit, int clobber_t1, uint8_t **text_segment);
 
 #endif
@@ -8,6 +8,9 @@
  */
 
 #include "RISCV_32I_Assembler.h"
+#include "Linker.h"
+#include "immediate.h"
+#include "rvc.h"
 
 
 #include <stdlib.h>
@@ -28,23 +31,41 @@ struct sArgArray {
   size_t len;
 };
 
-enum eAssemblerState {
-  S_UNCLASSIFIED = 0,
-  S_DATA = 1,
-  S_TEXT = 2,
+// Operands of a base instruction once decoded, registers are numbers
+struct sOperands {
+  int rd;
+  int rs1;
+  int rs2;
+  int32_t imm;
 };
 
-static struct sAssembledInstruction *_instruction_to_binary(struct sArgArray struct_args);
-static struct sAssembledInstruction *_psuedo_to_binary(struct sArgArray struct_args);
-static struct sAssembledData *_data_to_binary(struct sArgArray struct_args, int data_type);
-
-static int _check_psuedo(char *opName);
-
-static void _assemble_r_type(uint32_t *binary,
-  struct sArgArray struct_args, uint32_t opcode,
-  uint32_t funct3, uint32_t funct7);
-static void _assemble_i_type(uint32_t *binary,
-  struct sArgArray struct_args, uint32_t opcode, uint32_t funct3);
+// Most tokens an instruction takes, mnemonic included
+#define MAX_INST_ARGS (4)
+
+static int _assemble_instruction(struct sAssembledProgram *program,
+  struct line *line);
+static uint32_t _text_halfwords(const struct sAssembledProgram *program,
+  struct line *line);
+static uint32_t _psuedo_words(const struct sAssembledProgram *program,
+  linetype type, int32_t value, uint32_t target, size_t *first);
+static int _label_known(const struct sAssembledProgram *program, uint32_t label);
+static int _encode_deferred(struct sAssembler *assembler);
+static int _instruction_to_binary(struct sAssembledProgram *program,
+  linetype type, struct sArgArray struct_args, uint32_t target);
+static int _decode(linetype type, struct sArgArray struct_args,
+  struct sOperands *ops);
+static uint32_t _encode(linetype type, const struct sOperands *ops);
+static int _psuedo_to_binary(struct sAssembledProgram *program,
+  linetype type, struct sArgArray struct_args, uint32_t target);
+static int _data_to_binary(struct sAssembledProgram *program,
+  struct line *line);
+
+static int _emit(struct sAssembledProgram *program, uint32_t binary,
+  enum eLinkerCode linker_code, uint32_t target);
+static uint8_t *_emit_data(struct sAssembledProgram *program, size_t len);
+static int _add_label(struct sAssembledProgram *program,
+  enum eAssemblerState segment, uint32_t label);
+static void *_grow(void *array, size_t *cap, size_t need, size_t size);
 
 static void _bind_opcode(uint32_t *instr, uint32_t opcode);
 static void _bind_rd(uint32_t *instr, uint32_t rd);
@@ -54,107 +75,185 @@ static void _bind_rs2(uint32_t *instr, uint32_t rs2);
 static void _bind_funct7(uint32_t *instr, uint32_t funct7);
 
 static void _bind_imm_s_type(uint32_t *instr, uint32_t immediate);
-static void _bind_shamt_srai(uint32_t *instr, uint32_t shamt);
 static void _bind_shamt_i_type(uint32_t *instr, uint32_t shamt);
 
 
 static uint32_t _sign_reduce(uint32_t value, int width);
 
-static int _get_imm(char *imm_str);
-static int _get_imm_and_ptr(char *imm_str, char **ptr);
-static int _get_reg(char *reg_name);
-static char *_get_arg(struct token_node *parts, int index);
-static struct sArgArray _token_list_to_array(struct token_node *argument);
+static int _imm_operand(const char *operand, int bits, int is_signed, int32_t *imm);
+static int _get_reg(const char *name, size_t len);
+static int _reg_operand(const char *operand);
+static int _mem_operand(const char *operand, int bits, int32_t *imm);
+static struct sArgArray _line_to_args(struct line *line, char **array);
 
 /*
 ----------------------------------
 ------------ DEFINES -------------
 ----------------------------------
 Includes:
-  -Registers and their abi names.
-  -Psuedo instructions.
+  -Instruction encodings.
+*/
+// Register numbers of the ABI names
+#define REG_RA (1)
+
+
+/*
+  Encoding of every base instruction, indexed by mnemonic ID (linetype - INST).
+  The format decides which fields are bound, the shape how the operands are
+  written. Adding an instruction means adding a row here.
 */
-#define NUM_PSUEDO_INSTS (8)
-char *psuedo_instructions[NUM_PSUEDO_INSTS] = {
-  "j",
-  "la",
-  "li",
-  "mv",
-  "neg",
-  "nop",
-  "not",
-  "ret"
+enum eFormat {
+  FMT_R,
+  FMT_I,
+  FMT_SHIFT,      // I-type with a 5 bit shamt, funct7 in the upper bits
+  FMT_S,
+  FMT_B,
+  FMT_U,
+  FMT_J,
+};
+
+enum eShape {
+  SHAPE_RD_RS1_RS2,     // add rd, rs1, rs2
+  SHAPE_RD_RS1_IMM,     // addi rd, rs1, imm
+  SHAPE_RD_MEM,         // lw rd, imm(rs1)
+  SHAPE_RS2_MEM,        // sw rs2, imm(rs1)
+  SHAPE_RS1_RS2_LABEL,  // beq rs1, rs2, label
+  SHAPE_RD_LABEL,       // jal [rd,] label  (rd defaults to ra)
+  SHAPE_RD_IMM,         // lui rd, imm
+};
+
+struct sEncoding {
+  enum eFormat format;
+  enum eShape shape;
+  uint8_t opcode;
+  uint8_t funct3;
+  uint8_t funct7;
+  enum eLinkerCode linker_code;   // how the linker fills in a label operand
+};
+
+#define ENCODING(type) [(type) - INST]
+static const struct sEncoding encodings[INST_PSUEDO - INST] = {
+  //                      format     shape                opcode funct3 funct7 linker
+  ENCODING(INST_ADD)   = {FMT_R,     SHAPE_RD_RS1_RS2,    0x33,  0x0,   0x00,  LINKER_NONE},
+  ENCODING(INST_ADDI)  = {FMT_I,     SHAPE_RD_RS1_IMM,    0x13,  0x0,   0x00,  LINKER_NONE},
+  ENCODING(INST_AND)   = {FMT_R,     SHAPE_RD_RS1_RS2,    0x33,  0x7,   0x00,  LINKER_NONE},
+  ENCODING(INST_ANDI)  = {FMT_I,     SHAPE_RD_RS1_IMM,    0x13,  0x7,   0x00,  LINKER_NONE},
+  ENCODING(INST_AUIPC) = {FMT_U,     SHAPE_RD_IMM,        0x17,  0x0,   0x00,  LINKER_NONE},
+  ENCODING(INST_BEQ)   = {FMT_B,     SHAPE_RS1_RS2_LABEL, 0x63,  0x0,   0x00,  LINKER_BRANCH},
+  ENCODING(INST_BNE)   = {FMT_B,     SHAPE_RS1_RS2_LABEL, 0x63,  0x1,   0x00,  LINKER_BRANCH},
+  ENCODING(INST_JAL)   = {FMT_J,     SHAPE_RD_LABEL,      0x6F,  0x0,   0x00,  LINKER_JAL},
+  ENCODING(INST_JALR)  = {FMT_I,     SHAPE_RD_MEM,        0x67,  0x0,   0x00,  LINKER_NONE},
+  ENCODING(INST_LUI)   = {FMT_U,     SHAPE_RD_IMM,        0x37,  0x0,   0x00,  LINKER_NONE},
+  ENCODING(INST_LW)    = {FMT_I,     SHAPE_RD_MEM,        0x03,  0x2,   0x00,  LINKER_NONE},
+  ENCODING(INST_OR)    = {FMT_R,     SHAPE_RD_RS1_RS2,    0x33,  0x6,   0x00,  LINKER_NONE},
+  ENCODING(INST_ORI)   = {FMT_I,     SHAPE_RD_RS1_IMM,    0x13,  0x6,   0x00,  LINKER_NONE},
+  ENCODING(INST_SLT)   = {FMT_R,     SHAPE_RD_RS1_RS2,    0x33,  0x2,   0x00,  LINKER_NONE},
+  ENCODING(INST_SLTI)  = {FMT_I,     SHAPE_RD_RS1_IMM,    0x13,  0x2,   0x00,  LINKER_NONE},
+  ENCODING(INST_SLL)   = {FMT_R,     SHAPE_RD_RS1_RS2,    0x33,  0x1,   0x00,  LINKER_NONE},
+  ENCODING(INST_SLLI)  = {FMT_SHIFT, SHAPE_RD_RS1_IMM,    0x13,  0x1,   0x00,  LINKER_NONE},
+  ENCODING(INST_SRA)   = {FMT_R,     SHAPE_RD_RS1_RS2,    0x33,  0x5,   0x20,  LINKER_NONE},
+  ENCODING(INST_SRAI)  = {FMT_SHIFT, SHAPE_RD_RS1_IMM,    0x13,  0x5,   0x20,  LINKER_NONE},
+  ENCODING(INST_SRL)   = {FMT_R,     SHAPE_RD_RS1_RS2,    0x33,  0x5,   0x00,  LINKER_NONE},
+  ENCODING(INST_SRLI)  = {FMT_SHIFT, SHAPE_RD_RS1_IMM,    0x13,  0x5,   0x00,  LINKER_NONE},
+  ENCODING(INST_SUB)   = {FMT_R,     SHAPE_RD_RS1_RS2,    0x33,  0x0,   0x20,  LINKER_NONE},
+  ENCODING(INST_SW)    = {FMT_S,     SHAPE_RS2_MEM,       0x23,  0x2,   0x00,  LINKER_NONE},
+  ENCODING(INST_XOR)   = {FMT_R,     SHAPE_RD_RS1_RS2,    0x33,  0x4,   0x00,  LINKER_NONE},
+  ENCODING(INST_XORI)  = {FMT_I,     SHAPE_RD_RS1_IMM,    0x13,  0x4,   0x00,  LINKER_NONE},
+};
+#undef ENCODING
+
+// Width of the immediate each format holds, and whether it is signed.
+// Branch and jump offsets come from the linker, which checks them.
+static const struct {
+  int bits;
+  int is_signed;
+} format_imm[] = {
+  [FMT_R] = {0, 0},
+  [FMT_I] = {12, 1},
+  [FMT_SHIFT] = {5, 0},
+  [FMT_S] = {12, 1},
+  [FMT_B] = {13, 1},
+  [FMT_U] = {20, 0},
+  [FMT_J] = {21, 1},
+};
+
+// Tokens each shape needs, mnemonic included (jal may leave out rd)
+static const size_t shape_tokens[] = {
+  [SHAPE_RD_RS1_RS2] = 4,
+  [SHAPE_RD_RS1_IMM] = 4,
+  [SHAPE_RD_MEM] = 3,
+  [SHAPE_RS2_MEM] = 3,
+  [SHAPE_RS1_RS2_LABEL] = 4,
+  [SHAPE_RD_LABEL] = 2,
+  [SHAPE_RD_IMM] = 3,
+};
+
+
+/*
+  Expansion of every psuedo instruction, indexed by mnemonic ID
+  (linetype - INST_PSUEDO). The written operands are decoded once, by the
+  shape, and each instruction of the expansion takes its fields from them.
+*/
+enum ePsuedoShape {
+  PSHAPE_NONE,          // nop
+  PSHAPE_LABEL,         // j label
+  PSHAPE_RD_LABEL,      // la rd, label
+  PSHAPE_RD_IMM,        // li rd, imm
+  PSHAPE_RD_RS,         // mv rd, rs
+};
+
+// Where a field of an expanded instruction comes from
+enum eOperand {
+  OPD_X0,               // register 0, or an immediate of 0
+  OPD_RA,
+  OPD_RD,               // the written registers
+  OPD_RS,
+  OPD_LO12,             // the low 12 bits of the immediate, sign extended
+  OPD_HI20,             // the upper 20 bits, rounded up when OPD_LO12 is
+                        // negative so that adding it gives the immediate
+  OPD_ONES,             // an immediate of -1
+};
+
+struct sExpansion {
+  linetype type;
+  enum eOperand rd, rs1, rs2, imm;
+  enum eLinkerCode linker_code;   // LINKER_NONE or how to fill in the label
 };
 
-#define NUM_REGS (32)
-char *abi_registers[NUM_REGS] = {
-  "zero",
-  "ra",
-  "sp",
-  "gp",
-  "tp",
-  "t0",
-  "t1",
-  "t2",
-  "s0",
-  "s1",
-  "a0",
-  "a1",
-  "a2",
-  "a3",
-  "a4",
-  "a5",
-  "a6",
-  "a7",
-  "s2",
-  "s3",
-  "s4",
-  "s5",
-  "s6",
-  "s7",
-  "s8",
-  "s9",
-  "s10",
-  "s11",
-  "t3",
-  "t4",
-  "t5",
-  "t6",
+// li and la pick the shortest run of their words, see _psuedo_words()
+struct sPsuedo {
+  enum ePsuedoShape shape;
+  struct sExpansion words[5];
 };
 
-char *registers[NUM_REGS] = {
-  "x0",
-  "x1",
-  "x2",
-  "x3",
-  "x4",
-  "x5",
-  "x6",
-  "x7",
-  "x8",
-  "x9",
-  "x10",
-  "x11",
-  "x12",
-  "x13",
-  "x14",
-  "x15",
-  "x16",
-  "x17",
-  "x18",
-  "x19",
-  "x20",
-  "x21",
-  "x22",
-  "x23",
-  "x24",
-  "x25",
-  "x26",
-  "x27",
-  "x28",
-  "x29",
-  "x30",
-  "x31",
+#define PSUEDO(type) [(type) - INST_PSUEDO]
+static const struct sPsuedo psuedos[NUM_LINETYPES - INST_PSUEDO] = {
+  //                  shape                type        rd      rs1     rs2     imm       linker
+  PSUEDO(INST_J)   = {PSHAPE_LABEL,     {{INST_JAL,   OPD_X0, OPD_X0, OPD_X0, OPD_X0,   LINKER_JAL}}},
+  // the constant rows are the same as li, for an address that is known
+  PSUEDO(INST_LA)  = {PSHAPE_RD_LABEL,  {{INST_ADDI,  OPD_RD, OPD_X0, OPD_X0, OPD_LO12, LINKER_NONE},
+                                         {INST_LUI,   OPD_RD, OPD_X0, OPD_X0, OPD_HI20, LINKER_NONE},
+                                         {INST_ADDI,  OPD_RD, OPD_RD, OPD_X0, OPD_LO12, LINKER_NONE},
+                                         {INST_AUIPC, OPD_RD, OPD_X0, OPD_X0, OPD_X0,   LINKER_LA_AUIPC},
+                                         {INST_ADDI,  OPD_RD, OPD_RD, OPD_X0, OPD_X0,   LINKER_LA_ADDI}}},
+  PSUEDO(INST_LI)  = {PSHAPE_RD_IMM,    {{INST_ADDI,  OPD_RD, OPD_X0, OPD_X0, OPD_LO12, LINKER_NONE},
+                                         {INST_LUI,   OPD_RD, OPD_X0, OPD_X0, OPD_HI20, LINKER_NONE},
+                                         {INST_ADDI,  OPD_RD, OPD_RD, OPD_X0, OPD_LO12, LINKER_NONE}}},
+  PSUEDO(INST_MV)  = {PSHAPE_RD_RS,     {{INST_ADDI,  OPD_RD, OPD_RS, OPD_X0, OPD_X0,   LINKER_NONE}}},
+  PSUEDO(INST_NEG) = {PSHAPE_RD_RS,     {{INST_SUB,   OPD_RD, OPD_X0, OPD_RS, OPD_X0,   LINKER_NONE}}},
+  PSUEDO(INST_NOP) = {PSHAPE_NONE,      {{INST_ADDI,  OPD_X0, OPD_X0, OPD_X0, OPD_X0,   LINKER_NONE}}},
+  PSUEDO(INST_NOT) = {PSHAPE_RD_RS,     {{INST_XORI,  OPD_RD, OPD_RS, OPD_X0, OPD_ONES, LINKER_NONE}}},
+  PSUEDO(INST_RET) = {PSHAPE_NONE,      {{INST_JALR,  OPD_X0, OPD_RA, OPD_X0, OPD_X0,   LINKER_NONE}}},
+};
+#undef PSUEDO
+
+// Tokens each psuedo shape needs, mnemonic included
+static const size_t psuedo_shape_tokens[] = {
+  [PSHAPE_NONE] = 1,
+  [PSHAPE_LABEL] = 2,
+  [PSHAPE_RD_LABEL] = 3,
+  [PSHAPE_RD_IMM] = 3,
+  [PSHAPE_RD_RS] = 3,
 };
 
 
@@ -169,448 +268,594 @@ char *registers[NUM_REGS] = {
 */
 
 
-struct sAssembledProgram assemble_program(struct line *line){
-
+void assembler_init(struct sAssembler *assembler){
   // Assign state to unclassified by defult
-  enum eAssemblerState state = S_UNCLASSIFIED;
-  struct sAssembledInstruction *head_instruction = NULL;
-  struct sAssembledInstruction *curr_instruction = NULL;
-  struct sAssembledInstruction *prev_instruction = NULL;
-  struct sAssembledData *head_data = NULL;
-  struct sAssembledData *curr_data = NULL;
-  struct sAssembledData *prev_data = NULL;
+  assembler->state = S_UNCLASSIFIED;
+  memset(&assembler->program, 0, sizeof(struct sAssembledProgram));
+  assembler->program.text_address = TEXT_ADDRESS;
+  assembler->program.data_address = DATA_ADDRESS;
+  assembler->program.data_limit = DATA_LIMIT;
+  assembler->pool = NULL;
+  assembler->deferred = NULL;
+  assembler->num_deferred = 0;
+  assembler->cap_deferred = 0;
+}
 
-  for(; line != NULL; line = line->next){
 
-    // STATE MACHINE
-    if (line->type == DATA){
-      state = S_DATA;
-      continue;
+void assembler_set_pool(struct sAssembler *assembler, struct pool *pool){
+  assembler->pool = pool;
+}
+
+
+void assembler_set_compressed(struct sAssembler *assembler, int compressed){
+  assembler->program.compressed = compressed;
+}
+
+
+void assembler_set_addresses(struct sAssembler *assembler, uint32_t text_address,
+  uint32_t data_address){
+  assembler->program.text_address = text_address;
+  assembler->program.data_address = data_address;
+}
+
+
+void assembler_set_data_limit(struct sAssembler *assembler, size_t limit){
+  assembler->program.data_limit = limit;
+}
+
+
+void assembler_set_relocatable(struct sAssembler *assembler, int relocatable){
+  assembler->program.relocatable = relocatable;
+}
+
+
+int assemble_line(struct line *line, void *ctx){
+  struct sAssembler *assembler = ctx;
+  struct sAssembledProgram *program = &assembler->program;
+
+  // STATE MACHINE
+  if (line->type == DATA){
+    assembler->state = S_DATA;
+    return 0;
+  }
+  if (line->type == TEXT){
+    assembler->state = S_TEXT;
+    return 0;
+  }
+
+  // Skip lines that don't fall under data or text
+  if (assembler->state == S_UNCLASSIFIED)
+    return 0;
+
+  if (assembler->state == S_DATA){
+
+    // TODO-Error/warning, not data type
+    if (line->type > WORD){
+      return 0;
     }
-    if (line->type == TEXT){
-      state = S_TEXT;
-      continue;
+
+    //set label if has a label, it marks the first byte of the directive
+    if (line->label != SYM_NONE && _add_label(program, S_DATA, line->label) != 0)
+      return -1;
+
+    // _data_to_binary appends the bytes to the data segment.
+    // The error has been reported, stop assembling
+    if (_data_to_binary(program, line) != 0){
+      return -1;
     }
 
 
-    // Skip lines that don't fall under data or text
-    if (state == S_UNCLASSIFIED)
-      continue;
+  } else if (assembler->state == S_TEXT){
 
-    //get argument array from token list
-    struct sArgArray struct_args = _token_list_to_array(line->token_listhead);
+    // TODO-Error/warning, not instruction
+    if (line->type < INST){
+      return 0;
+    }
 
-    if (state == S_DATA){
+    if (line->label != SYM_NONE && _add_label(program, S_TEXT, line->label) != 0)
+      return -1;
+
+    // With a pool the line only takes its place now, see _encode_deferred()
+    if (assembler->pool != NULL && !program->compressed){
+      assembler->deferred = _grow(assembler->deferred, &assembler->cap_deferred,
+        assembler->num_deferred + 1, sizeof(struct sDeferredLine));
+      assembler->deferred[assembler->num_deferred++] = (struct sDeferredLine){
+        .line = line, .start = (uint32_t)program->text_len};
+      program->text_len += _text_halfwords(program, line);
+      return 0;
+    }
 
-      // TODO-Error/warning, not data type
-      if (line->type > WORD){
-        continue;
-      }
+    // The error has been reported, stop assembling
+    if (_assemble_instruction(program, line) != 0){
+      return -1;
+    }
 
-      // _data_to_binary returns a sAssembledData struct that is put into curr_data
-      curr_data = _data_to_binary(struct_args, line->type);
 
-      // START CASES
-      if (curr_data == NULL){
-        continue;
-      }
-      //set label if has a label.
-      if (line->label != NULL){
-        curr_data->label = line->label;
-      }
+  }// S_TEXT
 
-      //  LINKED LIST CONSTRUCTION
-      if (head_data == NULL)
-        head_data = curr_data;
-      if (prev_data != NULL)
+  return 0;
+}
 
-        prev_data->next = curr_data;
 
-      prev_data = curr_data;
+int assembler_finish(struct sAssembler *assembler, struct sAssembledProgram *program){
+  int status = 0;
 
+  if (assembler->num_deferred > 0)
+    status = _encode_deferred(assembler);
+  free(assembler->deferred);
+  assembler->deferred = NULL;
+  assembler->num_deferred = 0;
+  assembler->cap_deferred = 0;
 
-    } else if (state == S_TEXT){
+  *program = assembler->program;
+  memset(&assembler->program, 0, sizeof(struct sAssembledProgram));
+  return status;
+}
 
-      // TODO-Error/warning, not instruction
-      if (line->type < INST){
-        continue;
-      }
 
-      // CHECKS IF PSUEDO OR REGULAR OPERATION
-      char *opName = struct_args.args[0];
-      if(_check_psuedo(opName)){
-        curr_instruction = _psuedo_to_binary(struct_args);
-      } else {
-        curr_instruction = _instruction_to_binary(struct_args);
-      }
+struct sAssembledProgram assemble_program(struct line *line){
+  struct sAssembler assembler;
+  struct sAssembledProgram program;
 
-      // START CASES
-      if (curr_instruction == NULL){
-        continue;
-      }
-      if (line->label != NULL){
-        curr_instruction->label = line->label;
-      }
+  assembler_init(&assembler);
+  for(; line != NULL; line = line->next){
+    assemble_line(line, &assembler);
+  }
+  assembler_finish(&assembler, &program);
+  return program;
+}
 
-      //  LINKED LIST CONSTRUCTION
-      if(head_instruction == NULL){
-        head_instruction = curr_instruction;
-      }
-      if(prev_instruction != NULL){
-        prev_instruction->next = curr_instruction;
-      }
 
-      //  Move to the last element of the linked list (this is for psuedo)
-      //  Multiple instructions could be returned in a list
-      for (; curr_instruction->next != NULL; curr_instruction = curr_instruction->next);
-      prev_instruction = curr_instruction;
+/*[[ PARALLEL ENCODING ]]
+  every text line already has its place, the index of its first instruction
+  being the sum of the sizes of the lines before it, so every label is
+  defined. The lines are cut into chunks that are encoded at the same time,
+  each straight into its own part of text. Nothing is left to link but
+  undefined labels, which become fixups just as in the serial path.
+  */
+struct sEncodeChunk {
+  const struct sAssembledProgram *program;
+  const struct sDeferredLine *lines;
+  size_t num_lines;
+  uint32_t start, end;            // Halfwords of the chunk in text
+  struct sFixup *fixups;
+  size_t num_fixups;
+  int status;
+};
+
+// Pool task: encodes one chunk, as a program of its own
+static void _encode_chunk_task(void *ctx, size_t i){
+  struct sEncodeChunk *chunk = &((struct sEncodeChunk *)ctx)[i];
+  struct sAssembledProgram part;
+
+  memset(&part, 0, sizeof(struct sAssembledProgram));
+  part.text = chunk->program->text + chunk->start;
+  part.text_cap = chunk->end - chunk->start;
+  part.text_origin = chunk->start;
+  part.relocatable = chunk->program->relocatable;
+  part.text_address = chunk->program->text_address;
+  part.data_address = chunk->program->data_address;
+  part.definitions = chunk->program->definitions;
+  part.num_definitions = chunk->program->num_definitions;
+
+  chunk->status = 0;
+  for (size_t l = 0; l < chunk->num_lines && chunk->status == 0; l++){
+    // Lines that fail emit less than they were sized for, never more
+    part.text_len = chunk->lines[l].start - chunk->start;
+    chunk->status = _assemble_instruction(&part, chunk->lines[l].line);
+    assert(part.text_cap == chunk->end - chunk->start);
+  }
+  chunk->fixups = part.fixups;
+  chunk->num_fixups = part.num_fixups;
+}
+
+static int _encode_deferred(struct sAssembler *assembler){
+  struct sAssembledProgram *program = &assembler->program;
+  size_t num_lines = assembler->num_deferred;
+  size_t n = (size_t)pool_size(assembler->pool) * 4;
+  struct sEncodeChunk *chunks;
+  int status = 0;
+
+  if (n > num_lines)
+    n = num_lines;
+  chunks = calloc(n, sizeof(struct sEncodeChunk));
+  assert(chunks != NULL);
+
+  // text is allocated once, at its final size
+  program->text = _grow(program->text, &program->text_cap, program->text_len,
+    sizeof(uint16_t));
+
+  for (size_t i = 0; i < n; i++){
+    size_t begin = num_lines / n * i;
+    size_t end = i == n - 1 ? num_lines : num_lines / n * (i + 1);
+
+    chunks[i].program = program;
+    chunks[i].lines = assembler->deferred + begin;
+    chunks[i].num_lines = end - begin;
+    chunks[i].start = assembler->deferred[begin].start;
+    chunks[i].end = end < num_lines ? assembler->deferred[end].start
+      : (uint32_t)program->text_len;
+  }
 
+  pool_run(assembler->pool, n, _encode_chunk_task, chunks);
+
+  // Fixups are gathered in chunk order, so they stay ordered by offset
+  for (size_t i = 0; i < n; i++){
+    if (chunks[i].status != 0)
+      status = -1;
+    if (chunks[i].num_fixups > 0){
+      program->fixups = _grow(program->fixups, &program->cap_fixups,
+        program->num_fixups + chunks[i].num_fixups, sizeof(struct sFixup));
+      memcpy(program->fixups + program->num_fixups, chunks[i].fixups,
+        chunks[i].num_fixups * sizeof(struct sFixup));
+      program->num_fixups += chunks[i].num_fixups;
+    }
+    free(chunks[i].fixups);
+  }
+  free(chunks);
+  return status;
+}
 
-    }// S_TEXT
 
-    free(struct_args.args);
-  }// for
+// Assembles the instruction on line into program
+static int _assemble_instruction(struct sAssembledProgram *program,
+  struct line *line){
 
-  return (struct sAssembledProgram){.data = head_data, .text = head_instruction};
+  //get argument array from the line's tokens
+  char *array[MAX_INST_ARGS];
+  struct sArgArray struct_args = _line_to_args(line, array);
 
+  // CHECKS IF PSUEDO OR REGULAR OPERATION
+  // (the parser already classified the mnemonic, see linetype)
+  // Every instruction emitted that needs linking refers to the target the
+  // parser found on the line.
+  if(line->type >= INST_PSUEDO){
+    return _psuedo_to_binary(program, line->type, struct_args, line->target);
+  }
+  return _instruction_to_binary(program, line->type, struct_args, line->target);
+}
+
+
+// Number of halfwords the line assembles to, if it were emitted next and
+// not compressed. Lines with an error are given one instruction, they are
+// reported when they are encoded.
+static uint32_t _text_halfwords(const struct sAssembledProgram *program,
+  struct line *line){
+  const char *end;
+  int64_t value = 0;
+  size_t first;
+
+  if (line->type < INST_PSUEDO)
+    return 2;
+  if (line->type == INST_LI && (line->num_tokens < 3 ||
+      imm_parse(line_token(line, 2), &end, &value) != 0))
+    return 2;
+  return 2 * _psuedo_words(program, line->type, (int32_t)value, line->target, &first);
+}
+
+
+void program_free(struct sAssembledProgram *program){
+  free(program->text);
+  free(program->data);
+  free(program->fixups);
+  free(program->text_labels);
+  free(program->data_labels);
+  free(program->definitions);
+  memset(program, 0, sizeof(struct sAssembledProgram));
+}
+
+
+uint32_t program_address(const struct sAssembledProgram *program, uint32_t label){
+  if (label >= program->num_definitions)
+    return ADDRESS_UNDEFINED;
+  return program->definitions[label].address;
 }
 
 /*[[ DATA TO BINARY]]
-  converts anything in the data section to its binary representation.
+  converts anything in the data section to its binary representation, and
+  appends it to the data segment. Alignment and space are zero bytes.
   is like _instruction_to_binary, except for the data segment instead of text.
   */
-static struct sAssembledData *_data_to_binary(struct sArgArray struct_args, int data_type){
+static int _data_to_binary(struct sAssembledProgram *program,
+  struct line *line){
 
-  struct sAssembledData *assembled_data =
-    calloc(1, sizeof(struct sAssembledData));
-  assert(assembled_data != NULL);
+  int32_t value;
+  uint8_t *data;
 
-  switch(data_type){
+  if (line->num_tokens < 2){
+    fprintf(stderr, "Assembler error, missing operands: %s\n", line_token(line, 0));
+    return -1;
+  }
+
+  switch(line->type){
+    // a power of two, as in .align 4 for 16 bytes
     case ALIGN:{
-      assembled_data->arg_n = _get_imm(struct_args.args[1]);
-      assembled_data->linker_code = LINKER_ALIGN;
+      if (_imm_operand(line_token(line, 1), 5, 0, &value) != 0)
+        return -1;
+      if (value > MAX_ALIGN){
+        fprintf(stderr, "Assembler error, .align is at most %d: %s\n", MAX_ALIGN,
+          line_token(line, 1));
+        return -1;
+      }
+      size_t rem = program->data_len % ((size_t)1 << value);
+      if (((uint32_t)1 << value) > program->data_align)
+        program->data_align = (uint32_t)1 << value;
+      if (rem > 0)
+        memset(_emit_data(program, ((size_t)1 << value) - rem), 0,
+          ((size_t)1 << value) - rem);
       break;
     }
 
+    // the string between the quotes, and its NUL
     case ASCIIZ:{
-
-      char *str = (char*)malloc(strlen(struct_args.args[1]) + 1);
-      strcpy(str, struct_args.args[1]);
-      str = strtok(str, "\"");
-      assembled_data->data = (uint8_t*)str;
-      assembled_data->data_len = strlen(str) + 1;
-
+      const char *str = line_token(line, 1);
+      size_t len;
+
+      str += strspn(str, "\"");
+      len = strcspn(str, "\"");
+      data = _emit_data(program, len + 1);
+      memcpy(data, str, len);
+      data[len] = 0;
       break;
     }
 
     case SPACE:{
-      assembled_data->arg_n = _get_imm(struct_args.args[1]);
-      assembled_data->linker_code = LINKER_SPACE;
+      if (_imm_operand(line_token(line, 1), 32, 0, &value) != 0)
+        return -1;
+      // checked before the bytes are allocated, not only by the linker
+      if ((uint64_t)program->data_len + (uint32_t)value > program->data_limit){
+        fprintf(stderr, "Assembler error, .space goes past the data limit of %zu: %s\n",
+          program->data_limit, line_token(line, 1));
+        return -1;
+      }
+      memset(_emit_data(program, (uint32_t)value), 0, (uint32_t)value);
       break;
 
     }
     case WORD:{
-      assembled_data->data = (uint8_t*)malloc((struct_args.len - 1 ) * 4);
-      assembled_data->data_len = (struct_args.len - 1) * 4;
-      for (int i = 0; i < (struct_args.len - 1) * 4; i += 4){
-        uint32_t value = (uint32_t)_get_imm(struct_args.args[i / 4 + 1]);
-        assembled_data->data[i] = (uint8_t)(value >> 0);
-        assembled_data->data[i + 1] = (uint8_t)(value >> 8);
-        assembled_data->data[i + 2] = (uint8_t)(value >> 16);
-        assembled_data->data[i + 3] = (uint8_t)(value >> 24);
+      data = _emit_data(program, (line->num_tokens - 1) * 4);
+      for (uint32_t i = 0; i < (line->num_tokens - 1) * 4; i += 4){
+        // signed or unsigned, any 32-bit value goes
+        if (_imm_operand(line_token(line, i / 4 + 1), 33, 1, &value) != 0)
+          return -1;
+        data[i] = (uint8_t)(value >> 0);
+        data[i + 1] = (uint8_t)(value >> 8);
+        data[i + 2] = (uint8_t)(value >> 16);
+        data[i + 3] = (uint8_t)(value >> 24);
       }
       break;
     }
 
+    // only data directives come here
+    default:
+      return -1;
   }//switch
-  return assembled_data;
+  return 0;
 }
 
 /*[[ INSTRUCTION TO BINARY]]
-  first finds out what instruction was used, then proceeds to
-  assemble using method sub-method calls to type based ordering.
-  */
-static struct sAssembledInstruction *_instruction_to_binary(struct sArgArray struct_args){
-
-  struct sAssembledInstruction *assembled_instruction =
-    calloc(1, sizeof(struct sAssembledInstruction));
-  assert(assembled_instruction != NULL);
-
-  // Get operation name (such as add) from the parsed in line (parser.c)
-  char *opName = struct_args.args[0];
-  // Default link is NULL
-  assembled_instruction->target_label = NULL;
-
-  /*------------ R-Type -------------*/
-  // numbers are: opcode, funct3, funct7
-  if( strcmp(opName, "add") == 0 ){
-    _assemble_r_type(&assembled_instruction->binary, struct_args, 0x33, 0x0, 0x00);
-  } else if( strcmp(opName, "sub" ) == 0 ){
-    _assemble_r_type(&assembled_instruction->binary, struct_args, 0x33, 0x0, 0x20);
-  } else if( strcmp(opName, "xor" ) == 0 ){
-    _assemble_r_type(&assembled_instruction->binary, struct_args, 0x33, 0x4, 0x00);
-  } else if( strcmp(opName, "or" ) == 0 ){
-    _assemble_r_type(&assembled_instruction->binary, struct_args, 0x33, 0x6, 0x00);
-  } else if( strcmp(opName, "and" ) == 0 ){
-    _assemble_r_type(&assembled_instruction->binary, struct_args, 0x33, 0x7, 0x00);
-  } else if( strcmp(opName, "sll" ) == 0 ){
-    _assemble_r_type(&assembled_instruction->binary, struct_args, 0x33, 0x1, 0x00);
-  } else if( strcmp(opName, "srl" ) == 0 ){
-    _assemble_r_type(&assembled_instruction->binary, struct_args, 0x33, 0x5, 0x00);
-  } else if( strcmp(opName, "sra" ) == 0 ){
-    _assemble_r_type(&assembled_instruction->binary, struct_args, 0x33, 0x5, 0x20);
-  } else if( strcmp(opName, "slt" ) == 0 ){
-    _assemble_r_type(&assembled_instruction->binary, struct_args, 0x33, 0x2, 0x00);
-  } /*else if( strcmp(opName, "sltu" ) == 0 ){
-    _assemble_r_type(&assembled_instruction->binary, struct_args, 0x33, 0x3, 0x00);
-  }
+  decodes the operands of a base instruction and emits it. Label operands
+  are left for the linker, as a fixup to target.
   */
+static int _instruction_to_binary(struct sAssembledProgram *program,
+  linetype type, struct sArgArray struct_args, uint32_t target){
 
-    /*------------ I-Type -------------*/
-    // numbers are: opcode, funct3
-    else if( strcmp(opName, "addi" ) == 0 ){
-    _assemble_i_type(&assembled_instruction->binary, struct_args, 0x13, 0x0);
-  } else if( strcmp(opName, "xori" ) == 0 ){
-    _assemble_i_type(&assembled_instruction->binary, struct_args, 0x13, 0x4);
-  } else if( strcmp(opName, "ori" ) == 0 ){
-    _assemble_i_type(&assembled_instruction->binary, struct_args, 0x13, 0x6);
-  } else if( strcmp(opName, "andi" ) == 0 ){
-    _assemble_i_type(&assembled_instruction->binary, struct_args, 0x13, 0x7);
-  }
-  else if( strcmp(opName, "slti" ) == 0 ){
-    _assemble_i_type(&assembled_instruction->binary, struct_args, 0x13, 0x2);
-  }
+  struct sOperands ops;
 
-  /*--------- I-Type Specials ----------*/
-  // These require some work that cannot be called using the regular methods
-  else if( strcmp(opName, "slli" ) == 0 ){
-    char *rd = struct_args.args[1];    //  1st argument
-    char *rs1 = struct_args.args[2];   //  2nd argument
-    char *imm = struct_args.args[3];   //  immediate
-
-    _bind_opcode(&assembled_instruction->binary, 0x13);             // 0010011
-    _bind_rd(&assembled_instruction->binary, _get_reg(rd));
-    _bind_funct3(&assembled_instruction->binary, 0x1);
-    _bind_rs1(&assembled_instruction->binary, _get_reg(rs1));
-    // passing to its own special immediate binder
-    _bind_shamt_i_type(&assembled_instruction->binary, (uint32_t)_get_imm(imm));
-  }
-  else if( strcmp(opName, "srli" ) == 0 ){
-    char *rd = struct_args.args[1];    //  1st argument
-    char *rs1 = struct_args.args[2];   //  2nd argument
-    char *imm = struct_args.args[3];   //  immediate
-
-    _bind_opcode(&assembled_instruction->binary, 0x13);             // 0010011
-    _bind_rd(&assembled_instruction->binary, _get_reg(rd));
-    _bind_funct3(&assembled_instruction->binary, 0x5);
-    _bind_rs1(&assembled_instruction->binary, _get_reg(rs1));
-    // passing to its own special immediate binder
-    _bind_shamt_i_type(&assembled_instruction->binary, (uint32_t)_get_imm(imm));
-  }
-  else if( strcmp(opName, "srai" ) == 0 ){
-    char *rd = struct_args.args[1];    //  ret argument
-    char *rs1 = struct_args.args[2];   //  2nd argument
-    char *imm = struct_args.args[3];   //  immediate
-
-    _bind_opcode(&assembled_instruction->binary, 0x13);             // 0010011
-    _bind_rd(&assembled_instruction->binary, _get_reg(rd));
-    _bind_funct3(&assembled_instruction->binary, 0x5);
-    _bind_rs1(&assembled_instruction->binary, _get_reg(rs1));
-    // passing to its own special immediate binder
-    _bind_shamt_srai(&assembled_instruction->binary, (uint32_t)_get_imm(imm));
-  }
-
-  /*------------ I-Type Loads -------------*/
-  // Loads (such as load word) require extra work to parse.
+  if (_decode(type, struct_args, &ops) != 0)
+    return -1;
+  return _emit(program, _encode(type, &ops), encodings[type - INST].linker_code,
+    target);
+} // _instruction_to_binary() end
 
-  else if( strcmp(opName, "lw" ) == 0 ){
-    char *rd = struct_args.args[1];
-    char *rs1;
-    int imm = _get_imm_and_ptr(struct_args.args[2], &rs1);
 
-    _bind_opcode(&assembled_instruction->binary, 0x3);             // 010011
-    _bind_rd(&assembled_instruction->binary, _get_reg(rd));
-    _bind_funct3(&assembled_instruction->binary, 0x2);
-    _bind_rs1(&assembled_instruction->binary, _get_reg(rs1));
-    _bind_imm_i_type(&assembled_instruction->binary, (uint32_t)imm);
-  }
+/*[[ DECODE ]]
+  looks up the encoding of the instruction by its mnemonic ID, and decodes
+  the operands according to their shape, checking that the immediate fits
+  the format.
+  */
+static int _decode(linetype type, struct sArgArray struct_args,
+  struct sOperands *ops){
 
+  const struct sEncoding *encoding = &encodings[type - INST];
+  int bits = format_imm[encoding->format].bits;
+  int is_signed = format_imm[encoding->format].is_signed;
+  char **args = struct_args.args;
 
-  /*------------ S-Type Jump -------------*/
-  else if( strcmp(opName, "sw" ) == 0 ){
-    char *rs1 = struct_args.args[1];
-    char *rs2;
-    int imm = _get_imm_and_ptr(struct_args.args[2], &rs2);
+  // Registers that are not part of the shape stay x0, and bind nothing
+  *ops = (struct sOperands){0, 0, 0, 0};
 
-    _bind_opcode(&assembled_instruction->binary, 0x23);             // 010011
-    _bind_rs1(&assembled_instruction->binary, _get_reg(rs1));
-    _bind_funct3(&assembled_instruction->binary, 0x2);
-    _bind_rs2(&assembled_instruction->binary, _get_reg(rs2));
-    _bind_imm_s_type(&assembled_instruction->binary, (uint32_t)imm);
+  if (struct_args.len < shape_tokens[encoding->shape]){
+    fprintf(stderr, "Assembler error, missing operands: %s\n", args[0]);
+    return -1;
   }
 
-  /*------------ B-Type Jump -------------*/
-  else if( strcmp(opName, "beq" ) == 0 ){
-    char *rs1 = struct_args.args[1];    //  1st argument
-    char *rs2 = struct_args.args[2];   //  2nd argument
-    char *target = struct_args.args[3];   //  target
+  /*------------ Operands -------------*/
+  switch (encoding->shape){
+    case SHAPE_RD_RS1_RS2:
+      ops->rd = _reg_operand(args[1]);
+      ops->rs1 = _reg_operand(args[2]);
+      ops->rs2 = _reg_operand(args[3]);
+      break;
 
-    _bind_opcode(&assembled_instruction->binary, 0x63);
-    _bind_rs1(&assembled_instruction->binary, _get_reg(rs1));
-    _bind_rs2(&assembled_instruction->binary, _get_reg(rs2));
-    _bind_funct3(&assembled_instruction->binary, 0x0);
-    assembled_instruction->target_label = target;
-    assembled_instruction->linker_code = LINKER_BRANCH;
+    case SHAPE_RD_RS1_IMM:
+      ops->rd = _reg_operand(args[1]);
+      ops->rs1 = _reg_operand(args[2]);
+      if (_imm_operand(args[3], bits, is_signed, &ops->imm) != 0)
+        return -1;
+      break;
 
-  }
-  else if( strcmp(opName, "bne" ) == 0 ){
-    char *rs1 = struct_args.args[1];      //  1st argument
-    char *rs2 = struct_args.args[2];      //  2nd argument
-    char *target = struct_args.args[3];   //  target
+    // the base register follows the offset, as in 8(sp)
+    case SHAPE_RD_MEM:
+      ops->rd = _reg_operand(args[1]);
+      ops->rs1 = _mem_operand(args[2], bits, &ops->imm);
+      break;
 
-    if (target == NULL){
-      // error function
-    }
+    case SHAPE_RS2_MEM:
+      ops->rs2 = _reg_operand(args[1]);
+      ops->rs1 = _mem_operand(args[2], bits, &ops->imm);
+      break;
 
-    _bind_opcode(&assembled_instruction->binary, 0x63);
-    _bind_rs1(&assembled_instruction->binary, _get_reg(rs1));
-    _bind_rs2(&assembled_instruction->binary, _get_reg(rs2));
-    _bind_funct3(&assembled_instruction->binary, 0x1);
-    assembled_instruction->target_label = target;
-    assembled_instruction->linker_code = LINKER_BRANCH;
-  }
+    case SHAPE_RS1_RS2_LABEL:
+      ops->rs1 = _reg_operand(args[1]);
+      ops->rs2 = _reg_operand(args[2]);
+      break;
 
-  /*------------ I-Type Jump -------------*/
-  // jalr is the only I-type jump.
-  else if( strcmp(opName, "jalr" ) == 0 ){
-    char *rd = struct_args.args[1];
-    char *rs1;
-    int imm = _get_imm_and_ptr(struct_args.args[2], &rs1);
-
-    _bind_opcode(&assembled_instruction->binary, 0x67);             // 010011
-    _bind_rs1(&assembled_instruction->binary, _get_reg(rs1));
-    _bind_funct3(&assembled_instruction->binary, 0x0);
-    _bind_rd(&assembled_instruction->binary, _get_reg(rd));
-    _bind_imm_i_type(&assembled_instruction->binary, (uint32_t)imm);
-  }
+    // If jal has no return register it links to ra
+    case SHAPE_RD_LABEL:
+      ops->rd = struct_args.len > 2 ? _reg_operand(args[1]) : REG_RA;
+      break;
 
-  // J-Type
-  else if( strcmp(opName, "jal" ) == 0 ){
+    case SHAPE_RD_IMM:
+      ops->rd = _reg_operand(args[1]);
+      if (_imm_operand(args[2], bits, is_signed, &ops->imm) != 0)
+        return -1;
+      break;
+  }
 
-    char *arg1 = struct_args.args[1];      //  ret argument
-    char *arg2 = struct_args.args[2];  //  target
+  // The bad operand has been reported
+  if (ops->rd < 0 || ops->rs1 < 0 || ops->rs2 < 0)
+    return -1;
+  return 0;
+} // _decode() end
 
 
-    _bind_opcode(&assembled_instruction->binary, 0x6F);
-    // If jal has no target
-    if (arg2 == NULL){
-      _bind_rd(&assembled_instruction->binary, _get_reg("ra"));
-      assembled_instruction->target_label = arg1;
-    } else {
-      _bind_rd(&assembled_instruction->binary, _get_reg(arg1));
-      assembled_instruction->target_label = arg2;
-    }
-    assembled_instruction->linker_code = LINKER_JAL;
-  }
+/*[[ ENCODE ]]
+  binds the fields of the format of the instruction from decoded operands,
+  which must be in range. The encoding is a table lookup plus bit packing.
+  Label operands are left as 0.
+  */
+static uint32_t _encode(linetype type, const struct sOperands *ops){
+
+  const struct sEncoding *encoding = &encodings[type - INST];
+  uint32_t word = 0;
+  uint32_t *binary = &word;
+
+  _bind_opcode(binary, encoding->opcode);
+  switch (encoding->format){
+    case FMT_R:
+      _bind_rd(binary, ops->rd);
+      _bind_funct3(binary, encoding->funct3);
+      _bind_rs1(binary, ops->rs1);
+      _bind_rs2(binary, ops->rs2);
+      _bind_funct7(binary, encoding->funct7);
+      break;
 
-  // U-Type
-  else if( strcmp(opName, "lui" ) == 0 ){
+    case FMT_I:
+      _bind_rd(binary, ops->rd);
+      _bind_funct3(binary, encoding->funct3);
+      _bind_rs1(binary, ops->rs1);
+      _bind_imm_i_type(binary, (uint32_t)ops->imm);
+      break;
 
-    char *rd = struct_args.args[1];      //  rd
-    char *imm = struct_args.args[2];     //  imm
+    case FMT_SHIFT:
+      _bind_rd(binary, ops->rd);
+      _bind_funct3(binary, encoding->funct3);
+      _bind_rs1(binary, ops->rs1);
+      _bind_shamt_i_type(binary, (uint32_t)ops->imm);
+      _bind_funct7(binary, encoding->funct7);
+      break;
 
-    _bind_opcode(&assembled_instruction->binary, 0x37);             // 010011
-    _bind_rd(&assembled_instruction->binary, _get_reg(rd));
-    _bind_imm_u_type(&assembled_instruction->binary, (uint32_t)_get_imm(imm));
+    case FMT_S:
+      _bind_funct3(binary, encoding->funct3);
+      _bind_rs1(binary, ops->rs1);
+      _bind_rs2(binary, ops->rs2);
+      _bind_imm_s_type(binary, (uint32_t)ops->imm);
+      break;
 
-  } else if( strcmp(opName, "auipc" ) == 0 ){
-    char *rd = struct_args.args[1];      //  rd
-    char *imm = struct_args.args[2];     //  imm
+    // the offset is bound by the linker
+    case FMT_B:
+      _bind_funct3(binary, encoding->funct3);
+      _bind_rs1(binary, ops->rs1);
+      _bind_rs2(binary, ops->rs2);
+      break;
 
-    _bind_opcode(&assembled_instruction->binary, 0x17);             // 010011
-    _bind_rd(&assembled_instruction->binary, _get_reg(rd));
-    _bind_imm_u_type(&assembled_instruction->binary, (uint32_t)_get_imm(imm));
+    case FMT_U:
+      _bind_rd(binary, ops->rd);
+      _bind_imm_u_type(binary, (uint32_t)ops->imm);
+      break;
 
-  } else {
-    // TODO: unrecognized instruction
+    // the offset is bound by the linker
+    case FMT_J:
+      _bind_rd(binary, ops->rd);
+      break;
   }
 
-  return assembled_instruction;
-} // _instruction_to_binary() end
+  return word;
+} // _encode() end
 
 
 /*[[ PSUEDO INSTRUCTION TO BINARY ]]
-  first finds out what psuedo instruction was used, then proceeds to
-  assemble using each part and calls to _instruction_to_binary().
+  decodes the written operands of a psuedo instruction once, then encodes
+  each instruction of its expansion from them. Costs the same per word as
+  a base instruction.
 */
-static struct sAssembledInstruction *_psuedo_to_binary(struct sArgArray struct_args){
-
-  struct sAssembledInstruction *assembled_instruction =
-    calloc(1, sizeof(struct sAssembledInstruction));
-  assert(assembled_instruction != NULL);
-  // Default link is NULL
-  assembled_instruction->target_label = NULL;
-
-  // Get operation name (such as add) from the parsed in line
-  char *psuedoName = struct_args.args[0];
-
-  /*------------ PSUEDO-Type -------------*/
-  if( strcmp(psuedoName, "j") == 0 ){
-    char *array[] = {"jal", "x0", struct_args.args[1]};
-    struct sArgArray args = {array, 3};
-    assembled_instruction = _instruction_to_binary(args);
-
-  } else if( strcmp(psuedoName, "la") == 0 ){
-    char *array[] = {"auipc", struct_args.args[1], "0"};
-    struct sArgArray args = {array, 3};
-    assembled_instruction = _instruction_to_binary(args);
-    assembled_instruction->linker_code = LINKER_LA_AUIPC;
-    assembled_instruction->target_label = struct_args.args[2];
-
-    char *array2[] = {"addi", struct_args.args[1], struct_args.args[1], "0"};
-    struct sArgArray args2 = {array2, 4};
-    assembled_instruction->next = _instruction_to_binary(args2);
-    assembled_instruction->next->linker_code = LINKER_LA_AUIPC;
-    assembled_instruction->next->target_label = struct_args.args[2];
-
-  } else if( strcmp(psuedoName, "li") == 0 ){
-
-    char *array[] = {"addi", struct_args.args[1], "x0", struct_args.args[2]};
-    struct sArgArray args = {array, 4};
-    assembled_instruction = _instruction_to_binary(args);
-
-    //If over 12 bits, only 1 instruction
-    uint32_t imm = (uint32_t)_get_imm(struct_args.args[2]) >> 12;
-    if(imm){
-
-      char *array2[] = {"lui", struct_args.args[1], struct_args.args[2]};
-      struct sArgArray args2 = {array2, 3};
-      assembled_instruction->next = _instruction_to_binary(args2);
-    }
-
+static int _psuedo_to_binary(struct sAssembledProgram *program,
+  linetype type, struct sArgArray struct_args, uint32_t target){
+
+  const struct sPsuedo *psuedo = &psuedos[type - INST_PSUEDO];
+  size_t first, num_words;
+  char **args = struct_args.args;
+  int rd = 0, rs = 0;
+  int32_t value = 0;
+
+  if (struct_args.len < psuedo_shape_tokens[psuedo->shape]){
+    fprintf(stderr, "Assembler error, missing operands: %s\n", args[0]);
+    return -1;
+  }
 
-  } else if( strcmp(psuedoName, "mv") == 0 ){
-    char *array[] = {"addi", struct_args.args[1], struct_args.args[2], "0"};
-    struct sArgArray args = {array, 4};
-    assembled_instruction = _instruction_to_binary(args);
+  /*------------ Written operands -------------*/
+  switch (psuedo->shape){
+    case PSHAPE_NONE:
+    case PSHAPE_LABEL:
+      break;
 
-  } else if( strcmp(psuedoName, "neg") == 0 ){
-    char *array[] = {"sub", struct_args.args[1], "x0", struct_args.args[2]};
-    struct sArgArray args = {array, 4};
-    assembled_instruction = _instruction_to_binary(args);
+    case PSHAPE_RD_LABEL:
+      rd = _reg_operand(args[1]);
+      break;
 
-  } else if( strcmp(psuedoName, "nop") == 0 ){
-    char *array[] = {"addi", "x0", "x0", "0"};
-    struct sArgArray args = {array, 4};
-    assembled_instruction = _instruction_to_binary(args);
+    // signed or unsigned, any 32-bit value goes
+    case PSHAPE_RD_IMM:
+      rd = _reg_operand(args[1]);
+      if (_imm_operand(args[2], 33, 1, &value) != 0)
+        return -1;
+      break;
 
-  } else if( strcmp(psuedoName, "ret") == 0 ){
-    char *array[] = {"jalr", "x0", "x1", "0"};
-    struct sArgArray args = {array, 4};
-    assembled_instruction = _instruction_to_binary(args);
+    case PSHAPE_RD_RS:
+      rd = _reg_operand(args[1]);
+      rs = _reg_operand(args[2]);
+      break;
   }
 
-  return assembled_instruction;
+  // The bad operand has been reported
+  if (rd < 0 || rs < 0)
+    return -1;
+
+  /*------------ Expansion -------------*/
+  // la of a label that is known builds its address like li
+  if (psuedo->shape == PSHAPE_RD_LABEL && _label_known(program, target))
+    value = (int32_t)program_address(program, target);
+  num_words = _psuedo_words(program, type, value, target, &first);
+
+  const int32_t operands[] = {
+    [OPD_X0] = 0,
+    [OPD_RA] = REG_RA,
+    [OPD_RD] = rd,
+    [OPD_RS] = rs,
+    [OPD_LO12] = (int32_t)((uint32_t)value << 20) >> 20,
+    [OPD_HI20] = (int32_t)(((uint32_t)value + 0x800) >> 12),
+    [OPD_ONES] = -1,
+  };
+  for (size_t i = first; i < first + num_words; i++){
+    const struct sExpansion *word = &psuedo->words[i];
+    struct sOperands ops = {operands[word->rd], operands[word->rs1],
+      operands[word->rs2], operands[word->imm]};
+
+    if (_emit(program, _encode(word->type, &ops), word->linker_code,
+        word->linker_code != LINKER_NONE ? target : SYM_NONE) != 0)
+      return -1;
+  }
+  return 0;
 }// _psuedo_to_binary() end
 
 /*
@@ -621,147 +866,297 @@ static struct sAssembledInstruction *_psuedo_to_binary(struct sArgArray struct_a
 */
 
 
-/*------------ R-Type ASSEMBLE -------------*/
-static void _assemble_r_type(uint32_t *binary,
-  struct sArgArray struct_args, uint32_t opcode,
-  uint32_t funct3, uint32_t funct7){
-
-  char *rd = struct_args.args[1];    //  1st argument
-  char *rs1 = struct_args.args[2];   //  2nd argument
-  char *rs2 = struct_args.args[3];   //  3rd argument
-  char *opName = struct_args.args[0];
+/*------------ Emitting -------------*/
+// Number of words of the expansion of a psuedo instruction, starting at
+// first. A constant is an addi if it fits in 12 bits, a lui if its low 12
+// bits are 0, and lui+addi otherwise. la loads the address of a data label
+// that is already known the same way, else it is auipc+addi filled in by
+// the linker, as text labels move when it relaxes branches, and data ones
+// when objects are linked.
+// This is what _psuedo_to_binary() emits, and what text is sized by.
+static uint32_t _psuedo_words(const struct sAssembledProgram *program,
+  linetype type, int32_t value, uint32_t target, size_t *first){
+
+  *first = 0;
+  if (type == INST_LA){
+    if (!_label_known(program, target) || program->relocatable ||
+        program->definitions[target].segment != S_DATA){
+      *first = 3;
+      return 2;
+    }
+    value = (int32_t)program_address(program, target);
+  } else if (type != INST_LI){
+    return 1;
+  }
 
-  _bind_opcode(binary, opcode);   // 011001
-  _bind_rd(binary, _get_reg(rd));
-  _bind_funct3(binary, funct3);
-  _bind_rs1(binary, _get_reg(rs1));
-  _bind_rs2(binary, _get_reg(rs2));
-  _bind_funct7(binary, funct7);
+  if (imm_fits(value, 12, 1))
+    return 1;
+  *first = 1;
+  return (value & 0xFFF) == 0 ? 1 : 2;
 }
 
+// Whether label is defined before the instruction emitted next. Parallel
+// encoding knows every label, so this tells it which ones serial did not.
+static int _label_known(const struct sAssembledProgram *program, uint32_t label){
+  return label < program->num_definitions &&
+    program->definitions[label].address != ADDRESS_UNDEFINED &&
+    program->definitions[label].text_len <= program->text_origin + program->text_len;
+}
 
-/*------------ I-Type ASSEMBLE -------------*/
-static void _assemble_i_type(uint32_t *binary,
-  struct sArgArray struct_args, uint32_t opcode, uint32_t funct3){
-
-  char *rd = struct_args.args[1];    //  1st argument
-  char *rs1 = struct_args.args[2];   //  2nd argument
-  char *imm = struct_args.args[3];   //  immediate
-
-  _bind_opcode(binary, opcode);             // 010011
-  _bind_rd(binary, _get_reg(rd));
-  _bind_funct3(binary, funct3);
-  _bind_rs1(binary, _get_reg(rs1));
-  _bind_imm_i_type(binary, (uint32_t)_get_imm(imm));
+// Makes room for need elements of size in array, doubling its capacity.
+// Returns the array, which may have moved.
+static void *_grow(void *array, size_t *cap, size_t need, size_t size){
+  if (need <= *cap)
+    return array;
+
+  size_t new_cap = *cap ? *cap : 64;
+  while (new_cap < need)
+    new_cap *= 2;
+  array = realloc(array, new_cap * size);
+  assert(array != NULL);
+  *cap = new_cap;
+  return array;
 }
 
+// Appends an instruction to text. A label it refers to is filled in now if
+// it is defined and in reach, or else left for link_program(). It is a
+// fixup either way. Compressed if asked for, unless it is a la, or left to
+// be filled in.
+static int _emit(struct sAssembledProgram *program, uint32_t binary,
+  enum eLinkerCode linker_code, uint32_t target){
+
+  uint16_t compressed = 0;
+
+  program->text = _grow(program->text, &program->text_cap,
+    program->text_len + 2, sizeof(uint16_t));
+
+  if (linker_code != LINKER_NONE){
+    uint32_t address = program->text_address +
+      (uint32_t)(program->text_origin + program->text_len) * 2;
+    uint32_t target_address = program_address(program, target);
+    int resolved = target_address != ADDRESS_UNDEFINED &&
+      link_in_range(linker_code, address, target_address);
+
+    if (resolved){
+      if (link_fixup(&binary, linker_code, address, target, target_address) != 0)
+        return -1;
+      if (program->compressed &&
+          (linker_code == LINKER_JAL || linker_code == LINKER_BRANCH))
+        compressed = rvc_compress(binary);
+    }
+    program->fixups = _grow(program->fixups, &program->cap_fixups,
+      program->num_fixups + 1, sizeof(struct sFixup));
+    program->fixups[program->num_fixups++] = (struct sFixup){
+      .offset = (uint32_t)(program->text_origin + program->text_len),
+      .target = target,
+      .linker_code = linker_code,
+      .resolved = resolved};
+  } else if (program->compressed){
+    compressed = rvc_compress(binary);
+  }
 
-// Free the callocs of sAssembledInstruction
-void free_instructions(struct sAssembledInstruction *instruction){
-  struct sAssembledInstruction *next;
-  while (instruction != NULL){
-    next = instruction->next;
-    free(instruction);
-    instruction = next;
+  if (compressed != 0){
+    program->text[program->text_len++] = compressed;
+  } else {
+    program->text[program->text_len++] = (uint16_t)binary;
+    program->text[program->text_len++] = (uint16_t)(binary >> 16);
   }
+  return 0;
 }
 
-void free_data(struct sAssembledData *data){
-  struct sAssembledData *next;
-  while (data != NULL){
-    next = data->next;
-    free(data);
-    data = next;
+// Appends len bytes to data, returns them to be filled in
+static uint8_t *_emit_data(struct sAssembledProgram *program, size_t len){
+  program->data = _grow(program->data, &program->data_cap,
+    program->data_len + len, 1);
+  program->data_len += len;
+  return program->data + program->data_len - len;
+}
+
+// Defines label at the end of segment so far. Symbol IDs are dense, so the
+// definitions are a table indexed by them, and finding a label is a lookup.
+// Returns 0, or -1 if label was defined before.
+static int _add_label(struct sAssembledProgram *program,
+  enum eAssemblerState segment, uint32_t label){
+
+  struct sLabel **labels = &program->text_labels;
+  size_t *num = &program->num_text_labels, *cap = &program->cap_text_labels;
+  uint32_t offset = (uint32_t)program->text_len * 2;
+  uint32_t address = program->text_address + offset;
+
+  if (segment == S_DATA){
+    labels = &program->data_labels;
+    num = &program->num_data_labels;
+    cap = &program->cap_data_labels;
+    offset = (uint32_t)program->data_len;
+    address = program->data_address + offset;
+  }
+  if (label >= program->num_definitions){
+    size_t old = program->num_definitions;
+    program->definitions = _grow(program->definitions, &program->num_definitions,
+      label + 1, sizeof(struct sDefinition));
+    memset(program->definitions + old, 0xFF,
+      (program->num_definitions - old) * sizeof(struct sDefinition));
   }
+  if (program->definitions[label].address != ADDRESS_UNDEFINED){
+    fprintf(stderr, "Assembler error, label defined twice: %s\n", symtab_name(label));
+    return -1;
+  }
+  program->definitions[label].address = address;
+  program->definitions[label].text_len = (uint32_t)program->text_len;
+  program->definitions[label].segment = segment;
+
+  *labels = _grow(*labels, cap, *num + 1, sizeof(struct sLabel));
+  (*labels)[(*num)++] = (struct sLabel){.label = label, .offset = offset};
+  return 0;
 }
 
+
 /*------------ Convert Line Struct to Array -------------*/
-static struct sArgArray _token_list_to_array(struct token_node *argument){
-
-  // count number of arguments in struct
-  int num_args = 0;
-  struct token_node *next = argument;
-  while (next != NULL){
-    num_args++;
-    next = next->next;
-  }
+// array must hold MAX_INST_ARGS pointers, tokens past that are ignored.
+// Missing operands are left NULL.
+static struct sArgArray _line_to_args(struct line *line, char **array){
 
-  // Create an array of strings from the tokenized list.
-  char ** arg_array = (char**)malloc(num_args * sizeof(char*));
-  for (int i = 0; i < num_args; i++){
-    arg_array[i] = argument->token;
-    argument = argument->next;
+  size_t num_args = line->num_tokens;
+  if (num_args > MAX_INST_ARGS)
+    num_args = MAX_INST_ARGS;
+
+  // The tokens of a line sit next to each other in its buffer
+  for (size_t i = 0; i < MAX_INST_ARGS; i++){
+    array[i] = i < num_args ? line_token(line, i) : NULL;
   }
 
   // return a special instruction type sArgArray
-  return (struct sArgArray){.args = arg_array, .len = num_args};
+  return (struct sArgArray){.args = array, .len = num_args};
 }
 
 
 
-/*------------ Check for Psuedo Instr -------------*/
-// returns -1 if not a psuedo instruction
-// othereise, returns index from psuedo list
-static int _check_psuedo(char *opName){
-  for (int i = 0; i < NUM_PSUEDO_INSTS; i++){
-    if(!strcmp(opName, psuedo_instructions[i])){
-      return 1;
-    }
-  }
-  return 0;
+
+/*------------ Tools and Standards -------------*/
+// Reports an operand that is not a literal. A lone quote is what is left of
+// a character literal the lexer split.
+static void _bad_immediate(const char *operand){
+  if (strcmp(operand, "'") == 0 || strcmp(operand, "-'") == 0)
+    fprintf(stderr, "Assembler error, ' ', ',' and '#' cannot be character "
+      "literals, write their number instead\n");
+  else
+    fprintf(stderr, "Assembler error, bad immediate: %s\n", operand);
 }
 
+// Converts the string immidiate to numerical format, and checks that it
+// fits in bits (33 signed bits take any 32-bit value). Reports it if not.
+static int _imm_operand(const char *operand, int bits, int is_signed, int32_t *imm){
+  const char *end;
+  int64_t value;
 
+  if (imm_parse(operand, &end, &value) != 0 || *end != 0){
+    _bad_immediate(operand);
+    return -1;
+  }
+  if (!imm_fits(value, bits, is_signed)){
+    fprintf(stderr, "Assembler error, immediate does not fit in %d bits: %s\n",
+      bits > 32 ? 32 : bits, operand);
+    return -1;
+  }
+  *imm = (int32_t)value;
+  return 0;
+}
 
-/*------------ Tools and Standards -------------*/
-// Converts the string immidiate to numerical format (int), and pointer
-static int _get_imm_and_ptr(char *imm_str, char **ptr){
-  if (strncmp("0x", imm_str, 2) == 0)
-    return strtol(&imm_str[2], ptr, 16);
-  //binary
-  if (strncmp("0b", imm_str, 2) == 0)
-    return strtol(&imm_str[2], ptr, 2);
-  //decimal by default
-  return strtol(imm_str, ptr, 10);
-}
-
-// Converts the string immidiate to numerical format (int)
-static int _get_imm(char *imm_str){
-  char *ptr;
-  //hex
-  if (strncmp("0x", imm_str, 2) == 0)
-    return strtol(&imm_str[2], &ptr, 16);
-  //binary
-  if (strncmp("0b", imm_str, 2) == 0)
-    return strtol(&imm_str[2], &ptr, 2);
-  //decimal by default
-  return strtol(imm_str, &ptr, 10);
-}
-
-// gets argument in the parsed line
-// index is argument location
-static char *_get_arg(struct token_node *parts, int index){
-  for (int i = 0; i < index; i++){
-    if (parts->next == NULL)
-      return NULL;
-    parts = parts->next;
+// Reads a register number of one or two digits without leading zeros,
+// up to max. Returns -1 if it is anything else.
+static int _reg_number(const char *digits, size_t len, int max){
+  int n;
+  if (len == 1 && digits[0] >= '0' && digits[0] <= '9'){
+    n = digits[0] - '0';
+  } else if (len == 2 && digits[0] >= '1' && digits[0] <= '9' && digits[1] >= '0' && digits[1] <= '9'){
+    n = (digits[0] - '0') * 10 + (digits[1] - '0');
+  } else {
+    return -1;
   }
-  return parts->token;
+  return n <= max ? n : -1;
 }
 
-// get numerial representation of a register
-// !IMOPRTANT NOTE: I must be decremented here as strstr() needs it:
-//   -> strstr() could get x1 instead of x11 first, and thus ruin the register lookup.
-static int _get_reg(char *reg_name){
-  for (int i = NUM_REGS-1; i >= 0; i--){
-    // if ( !strcmp(reg_name, registers[i]) || !strcmp(reg_name, abi_registers[i]) ){
-    if ( strstr(reg_name, registers[i]) != NULL || strstr(reg_name, abi_registers[i]) != NULL ){
-      return i;
-    }
+// get numerial representation of a register, from its x-name or ABI name.
+// Only exact names match, dispatching on the first character.
+// Returns -1 if name is not a register.
+static int _get_reg(const char *name, size_t len){
+  int n;
+
+  if (len < 2 || len > 4)
+    return -1;
+
+  switch (name[0]){
+    case 'x':
+      return _reg_number(name + 1, len - 1, 31);
+    // a0-a7 are x10-x17
+    case 'a':
+      n = _reg_number(name + 1, len - 1, 7);
+      return n < 0 ? -1 : 10 + n;
+    // t0-t2 are x5-x7, t3-t6 are x28-x31
+    case 't':
+      if (len == 2 && name[1] == 'p')
+        return 4;
+      n = _reg_number(name + 1, len - 1, 6);
+      return n < 0 ? -1 : (n < 3 ? 5 + n : 25 + n);
+    // s0-s1 are x8-x9, s2-s11 are x18-x27
+    case 's':
+      if (len == 2 && name[1] == 'p')
+        return 2;
+      n = _reg_number(name + 1, len - 1, 11);
+      return n < 0 ? -1 : (n < 2 ? 8 + n : 16 + n);
+    case 'z':
+      return (len == 4 && memcmp(name, "zero", 4) == 0) ? 0 : -1;
+    case 'r':
+      return (len == 2 && name[1] == 'a') ? REG_RA : -1;
+    case 'g':
+      return (len == 2 && name[1] == 'p') ? 3 : -1;
+    // fp is another name for s0
+    case 'f':
+      return (len == 2 && name[1] == 'p') ? 8 : -1;
   }
   return -1;
 }
 
+// Register of a register operand, reports it if it is not one.
+// Names are at most 4 characters, so no more than 5 need to be looked at.
+static int _reg_operand(const char *operand){
+  int reg = _get_reg(operand, strnlen(operand, 5));
+  if (reg < 0)
+    fprintf(stderr, "Assembler error, unknown register: %s\n", operand);
+  return reg;
+}
+
+// Base register of a memory operand, imm(reg), with a signed offset of
+// bits that may be left out. Reports it if the operand is not one.
+static int _mem_operand(const char *operand, int bits, int32_t *imm){
+  const char *end = operand;
+  int64_t value = 0;
+  size_t len = 0;
+  int reg = -1;
+
+  if (operand[0] != '(' && imm_parse(operand, &end, &value) != 0){
+    _bad_immediate(operand);
+    return -1;
+  }
+  if (!imm_fits(value, bits, 1)){
+    fprintf(stderr, "Assembler error, immediate does not fit in %d bits: %s\n",
+      bits, operand);
+    return -1;
+  }
+  *imm = (int32_t)value;
+
+  operand = end;
+  if (operand[0] == '('){
+    while (len < 5 && operand[1 + len] != ')' && operand[1 + len] != 0)
+      len++;
+    if (operand[1 + len] == ')' && operand[2 + len] == 0)
+      reg = _get_reg(operand + 1, len);
+  }
+  if (reg < 0)
+    fprintf(stderr, "Assembler error, expected (register) after the offset: %s\n", operand);
+  return reg;
+}
+
 
 
 /*
@@ -804,16 +1199,10 @@ void _bind_imm_i_type(uint32_t *instr, uint32_t immediate){
   immediate = _sign_reduce(immediate, 12);
   *instr |= (uint32_t)(immediate & 0xFFF) << 20;
 }
-// Immediate special for slli, srli
+// Immediate special for slli, srli, srai (srai sets funct7 on top)
 static void _bind_shamt_i_type(uint32_t *instr, uint32_t shamt){
   *instr |= (uint32_t)(shamt & 0x1F) << 20;
 }
-// Immediate special for srai
-static void _bind_shamt_srai(uint32_t *instr, uint32_t shamt){
-  shamt &= 0x1F;
-  shamt |= 0x20;          //  [5:11] = 0x20, reveresed so is 0x40
-  *instr |= shamt << 20;
-}
 // immediate-S-type (4:0 & 11:5)
 static void _bind_imm_s_type(uint32_t *instr, uint32_t immediate){
   immediate = _sign_reduce(immediate, 12);
@@ -824,7 +1213,7 @@ static void _bind_imm_s_type(uint32_t *instr, uint32_t immediate){
 }
 // immediate-B-type
 void _bind_imm_b_type(uint32_t *instr, uint32_t immediate){
-  immediate = _sign_reduce(immediate, 12);
+  immediate = _sign_reduce(immediate, 13);
   uint32_t im4_1, im11, im12, im10_5;
   im4_1 = (immediate >> 1) & 0xF;
   im10_5 = (immediate >> 5) & 0x3F;
@@ -832,10 +1221,9 @@ void _bind_imm_b_type(uint32_t *instr, uint32_t immediate){
   im12 = (immediate >> 12) & 1;
   *instr |= (im11 << 7) | (im4_1 << 8) | (im10_5 << 25) | (im12 << 31);
 }
-// immediate-U-type
+// immediate-U-type, the upper 20 bits (31:12)
 void _bind_imm_u_type(uint32_t *instr, uint32_t immediate){
-  // last 12 are = 0
-  *instr |= immediate & 0xFFFFF000;
+  *instr |= (immediate & 0xFFFFF) << 12;
 }
 // immediate-J-type (20|10:1|11|19:12)
 void _bind_imm_j_type(uint32_t *instr, uint32_t immediate){
@@ -852,7 +1240,7 @@ void _bind_imm_j_type(uint32_t *instr, uint32_t immediate){
 /*------------ Tools and Other -------------*/
 // reduce the sign of a 32 signed into given width signed
 static uint32_t _sign_reduce(uint32_t value, int width){
-  uint32_t sign = value >> 30;
+  uint32_t sign = value >> 31;
   uint32_t mask = (1 << (width - 1)) - 1;
-  return ( value & mask | sign << (width - 1) );
+  return ( (value & mask) | sign << (width - 1) );
 }
@@ -13,6 +13,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "parser.h"
+#include "pool.h"
 
 
 enum eLinkerCode {
@@ -21,36 +22,130 @@ enum eLinkerCode {
   LINKER_BRANCH = 2,
   LINKER_LA_AUIPC = 3,
   LINKER_LA_ADDI = 4,
-  LINKER_ALIGN = 5,
-  LINKER_SPACE = 6,
 };
 
 
-struct sAssembledData{
-  uint8_t *data;
-  size_t data_len;
-  char *label;
-  uint32_t arg_n;
-  enum eLinkerCode linker_code;
-  struct sAssembledData *next;
+enum eAssemblerState {
+  S_UNCLASSIFIED = 0,
+  S_DATA = 1,
+  S_TEXT = 2,
 };
 
-struct sAssembledInstruction {
-  uint32_t binary;            // Assembled binary instruction
-  char *target_label;         // Target label for b/j instructions (null others)
-  char *label;                // Label of present instruction (null if has none)
+// An instruction with a label operand. The linker fills in the ones that
+// are not yet, and all of them if relaxing moved text.
+struct sFixup {
+  uint32_t offset;            // Index of the first halfword of the instruction
+  uint32_t target;            // Symbol ID of the target for b/j/la
   enum eLinkerCode linker_code;
-  struct sAssembledInstruction *next;
+  int resolved;               // Filled in as it was assembled
+};
+
+// Where a label is, and how many halfwords text had when it was defined
+struct sDefinition {
+  uint32_t address;           // ADDRESS_UNDEFINED if not defined (yet)
+  uint32_t text_len;
+  enum eAssemblerState segment;
 };
 
+// A label and the byte offset it marks in its segment
+struct sLabel {
+  uint32_t label;             // Symbol ID of the label
+  uint32_t offset;
+};
+
+// Address of a label that has not been defined (yet)
+#define ADDRESS_UNDEFINED (0xFFFFFFFF)
+
+// Largest .align, a 4 KiB page
+#define MAX_ALIGN (12)
+
+// The program is emitted into growable arrays, in the order of the source.
+// Labels and fixups are side tables, ordered by offset. Addresses are known
+// as each line is assembled, so a reference to a label defined before it is
+// filled in right away, and only forward references are left to the linker.
+// Every reference is still a fixup, the linker may move text to widen a
+// branch that does not reach.
+// text is kept in halfwords, the unit instructions are sized in: an RVC
+// instruction takes one and any other two, low half first.
 struct sAssembledProgram {
-  struct sAssembledData *data;
-  struct sAssembledInstruction *text;
+  uint16_t *text;             // Assembled binary instructions
+  size_t text_len, text_cap;  // in halfwords
+  size_t text_origin;         // Index of text[0], for a part encoded on its own
+  int compressed;             // Emits RVC instructions where the operands allow
+  int relocatable;            // Leaves every address to the linker
+  uint32_t text_address;      // Where the segments are loaded
+  uint32_t data_address;
+  uint8_t *data;              // Data segment, alignment and space included
+  size_t data_len, data_cap;  // in bytes
+  uint32_t data_align;        // Largest .align in data, in bytes
+  size_t data_limit;          // Largest .space may grow data to
+  struct sFixup *fixups;
+  size_t num_fixups, cap_fixups;
+  struct sLabel *text_labels;
+  size_t num_text_labels, cap_text_labels;
+  struct sLabel *data_labels;
+  size_t num_data_labels, cap_data_labels;
+  struct sDefinition *definitions;   // of each label, indexed by symbol ID
+  size_t num_definitions;
+};
+
+// A text line left to be encoded, and the index of its first halfword
+struct sDeferredLine {
+  struct line *line;
+  uint32_t start;
+};
+
+// State carried from one line to the next, so lines can be assembled as the
+// parser produces them
+struct sAssembler {
+  enum eAssemblerState state;
+  struct sAssembledProgram program;
+  struct pool *pool;                // Encodes text in parallel if not NULL
+  struct sDeferredLine *deferred;
+  size_t num_deferred, cap_deferred;
 };
 
+void assembler_init(struct sAssembler *assembler);
+
+// Encodes the text on the threads of pool. Lines in .text are only sized as
+// they come, which places every label, and are encoded all at once by
+// assembler_finish(). They must stay alive until then.
+void assembler_set_pool(struct sAssembler *assembler, struct pool *pool);
+
+// Emits 16-bit RVC instructions where the operands allow, see rvc.h. The
+// size of a line then depends on all of its operands, so the text is
+// encoded as it comes even with a pool.
+void assembler_set_compressed(struct sAssembler *assembler, int compressed);
+
+// Loads the segments at these addresses instead of TEXT_ADDRESS and
+// DATA_ADDRESS, see Linker.h. Both must be word aligned.
+void assembler_set_addresses(struct sAssembler *assembler, uint32_t text_address,
+  uint32_t data_address);
+
+// Lets data grow up to limit bytes instead of DATA_LIMIT. The linker checks
+// the whole program, this only keeps .space from allocating far past it.
+void assembler_set_data_limit(struct sAssembler *assembler, size_t limit);
+
+// Assembles an object file to be linked with others, see object.h. la of a
+// data label then loads it relative to the PC like any other, since data
+// moves when objects are put together.
+void assembler_set_relocatable(struct sAssembler *assembler, int relocatable);
+
+// Assembles one line, a line_callback for parse_source(). Nothing in the
+// output points into the line, it may be released after the call.
+int assemble_line(struct line *line, void *assembler);
+
+// Hands over the program, which is released with program_free().
+// Returns 0, or -1 if a deferred line could not be assembled.
+int assembler_finish(struct sAssembler *assembler, struct sAssembledProgram *program);
+
+// Assembles a whole list of lines
 struct sAssembledProgram assemble_program(struct line *line);
-void free_instructions(struct sAssembledInstruction *instructions);
-void free_data(struct sAssembledData *data);
+
+// Address of label, or ADDRESS_UNDEFINED
+uint32_t program_address(const struct sAssembledProgram *program, uint32_t label);
+
+void program_free(struct sAssembledProgram *program);
 
 void _bind_imm_j_type(uint32_t *instr, uint32_t immediate);
 void _bind_imm_b_type(uint32_t *instr, uint32_t immediate);
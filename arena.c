@@ -0,0 +1,120 @@
+/*
+ * Arena allocator for CS4200 at UCCS, Fall 2021
+ *
+ *  PURPOSE: Own every object produced while parsing and assembling a program
+             so that allocation is a pointer bump and teardown is one reset.
+ */
+
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// Chunks double in size so a big program needs only a few of them
+#define ARENA_MIN_CHUNK (64 * 1024)
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;
+  size_t used;
+  max_align_t data[];
+};
+
+static size_t _align_up(size_t n){
+  return (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static struct arena_chunk *_new_chunk(size_t size){
+  struct arena_chunk *chunk = malloc(sizeof(struct arena_chunk) + size);
+  assert(chunk != NULL);
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+void arena_init(struct arena *arena){
+  arena->head = NULL;
+  arena->current = NULL;
+}
+
+void *arena_malloc(struct arena *arena, size_t size){
+  struct arena_chunk *chunk = arena->current;
+  size = _align_up(size);
+
+  // Fast path, bump the pointer in the current chunk
+  if (chunk != NULL && chunk->size - chunk->used >= size){
+    void *ptr = (char*)chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+  }
+
+  // Move on to a chunk left over from before a reset if it is big enough
+  if (chunk != NULL && chunk->next != NULL && chunk->next->size >= size){
+    chunk = chunk->next;
+    chunk->used = 0;
+  } else {
+    size_t chunk_size = ARENA_MIN_CHUNK;
+    if (chunk != NULL && chunk->size * 2 > chunk_size)
+      chunk_size = chunk->size * 2;
+    while (chunk_size < size)
+      chunk_size *= 2;
+
+    struct arena_chunk *fresh = _new_chunk(chunk_size);
+    if (chunk == NULL){
+      fresh->next = arena->head;
+      arena->head = fresh;
+    } else {
+      fresh->next = chunk->next;
+      chunk->next = fresh;
+    }
+    chunk = fresh;
+  }
+
+  arena->current = chunk;
+  chunk->used = size;
+  return chunk->data;
+}
+
+void *arena_calloc(struct arena *arena, size_t nmemb, size_t size){
+  void *ptr = arena_malloc(arena, nmemb * size);
+  memset(ptr, 0, nmemb * size);
+  return ptr;
+}
+
+void arena_reset(struct arena *arena){
+  // Later chunks are rewound lazily as allocation reaches them
+  arena->current = arena->head;
+  if (arena->head != NULL)
+    arena->head->used = 0;
+}
+
+void arena_free(struct arena *arena){
+  struct arena_chunk *next;
+  while (arena->head != NULL){
+    next = arena->head->next;
+    free(arena->head);
+    arena->head = next;
+  }
+  arena->current = NULL;
+}
+
+void arena_merge(struct arena *dst, struct arena *src){
+  struct arena_chunk *last;
+
+  if (src->head == NULL)
+    return;
+
+  // Splice in at the front, chunks ahead of current would be reused
+  for (last = src->head; last->next != NULL; last = last->next);
+  last->next = dst->head;
+  dst->head = src->head;
+  if (dst->current == NULL)
+    dst->current = last;
+
+  src->head = NULL;
+  src->current = NULL;
+}
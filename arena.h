@@ -0,0 +1,38 @@
+/*
+ * Arena allocator for CS4200 at UCCS, Fall 2021
+ *
+ *  PURPOSE: Own every object produced while parsing and assembling a program
+             so that allocation is a pointer bump and teardown is one reset.
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+struct arena {
+  struct arena_chunk *head;     // first chunk, chunks are kept for reuse
+  struct arena_chunk *current;  // chunk allocations are bumped from
+};
+
+void arena_init(struct arena *arena);
+
+// Like malloc(), memory is uninitialized and lives until reset/free
+void *arena_malloc(struct arena *arena, size_t size);
+
+// Like calloc(), memory is zeroed and lives until reset/free
+void *arena_calloc(struct arena *arena, size_t nmemb, size_t size);
+
+// Releases every allocation at once, keeping the chunks for reuse
+void arena_reset(struct arena *arena);
+
+// Returns all chunks to the operating system
+void arena_free(struct arena *arena);
+
+// Moves every allocation of src into dst, leaving src empty. Lets threads
+// fill arenas of their own that end up owned by one arena.
+void arena_merge(struct arena *dst, struct arena *src);
+
+#endif /* ARENA_H_ */
@@ -0,0 +1,120 @@
+/*
+ * Immediate parser for CS4200 at UCCS, Fall 2021
+ *
+ *  PURPOSE: Read the integer literals of instruction operands and data in
+             one pass, and check that they fit the field they go in.
+ */
+
+#include "immediate.h"
+
+#include <stddef.h>
+
+// Anything above this cannot be a 32-bit value, signed or unsigned
+#define IMM_MAX ((uint64_t)UINT32_MAX)
+
+// What a literal wider than 32 bits reads as, outside every field
+#define IMM_TOO_BIG ((int64_t)IMM_MAX + 1)
+#define IMM_TOO_SMALL (-(int64_t)IMM_MAX - 2)
+
+// Value of c as a digit in base, or -1 if it is not one
+static int _digit(char c, int base){
+  int d;
+  if (c >= '0' && c <= '9')
+    d = c - '0';
+  else if (c >= 'a' && c <= 'f')
+    d = c - 'a' + 10;
+  else if (c >= 'A' && c <= 'F')
+    d = c - 'A' + 10;
+  else
+    return -1;
+  return d < base ? d : -1;
+}
+
+// Reads the character literal after the opening quote at str
+static int _char_literal(const char *str, const char **end, uint64_t *value){
+  char c = *str++;
+
+  if (c == '\\'){
+    switch (*str++){
+      case 'n': c = '\n'; break;
+      case 't': c = '\t'; break;
+      case 'r': c = '\r'; break;
+      case '0': c = '\0'; break;
+      case '\\': c = '\\'; break;
+      case '\'': c = '\''; break;
+      case '"': c = '"'; break;
+      default: return -1;
+    }
+  } else if (c == '\'' || c == 0){
+    return -1;
+  }
+
+  if (*str != '\'')
+    return -1;
+  *end = str + 1;
+  *value = (uint8_t)c;
+  return 0;
+}
+
+int imm_parse(const char *str, const char **end, int64_t *value){
+  const char *p = str;
+  uint64_t acc = 0;
+  int negative = 0, base = 10, d;
+
+  if (*p == '-' || *p == '+'){
+    negative = (*p == '-');
+    p++;
+  }
+
+  if (*p == '\''){
+    if (_char_literal(p + 1, end, &acc) != 0)
+      return -1;
+    *value = negative ? -(int64_t)acc : (int64_t)acc;
+    return 0;
+  }
+
+  // The prefix picks the base, a lone 0 is just zero
+  if (p[0] == '0'){
+    if ((p[1] == 'x' || p[1] == 'X') && _digit(p[2], 16) >= 0){
+      base = 16;
+      p += 2;
+    } else if ((p[1] == 'b' || p[1] == 'B') && _digit(p[2], 2) >= 0){
+      base = 2;
+      p += 2;
+    } else if (_digit(p[1], 8) >= 0){
+      base = 8;
+      p += 1;
+    }
+  }
+
+  if (_digit(*p, base) < 0)
+    return -1;
+
+  // Stop accumulating past 32 bits so nothing can wrap, digits are still
+  // consumed to find the end. Decimal is by far the most common, and gets
+  // a loop of its own.
+  if (base == 10){
+    for (; (unsigned)(*p - '0') < 10; p++){
+      if (acc <= IMM_MAX)
+        acc = acc * 10 + (unsigned)(*p - '0');
+    }
+  } else {
+    for (; (d = _digit(*p, base)) >= 0; p++){
+      if (acc <= IMM_MAX)
+        acc = acc * base + d;
+    }
+  }
+
+  *end = p;
+  if (acc > IMM_MAX || (negative && acc > (uint64_t)1 << 31))
+    *value = negative ? IMM_TOO_SMALL : IMM_TOO_BIG;
+  else
+    *value = negative ? -(int64_t)acc : (int64_t)acc;
+  return 0;
+}
+
+int imm_fits(int64_t value, int bits, int is_signed){
+  if (is_signed)
+    return value >= -((int64_t)1 << (bits - 1)) && value < ((int64_t)1 << (bits - 1));
+  return value >= 0 && value < ((int64_t)1 << bits);
+}
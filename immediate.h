@@ -0,0 +1,26 @@
+/*
+ * Immediate parser for CS4200 at UCCS, Fall 2021
+ *
+ *  PURPOSE: Read the integer literals of instruction operands and data in
+             one pass, and check that they fit the field they go in.
+ */
+
+#ifndef IMMEDIATE_H_
+#define IMMEDIATE_H_
+
+#include <stdint.h>
+
+// Parses the literal at str: an optional sign, then a decimal number, 0x hex,
+// 0b binary, 0 octal or a 'c' character literal with the usual escapes.
+// end is set to the first character after it. Values from -2^31 up to 2^32-1
+// are read as they are, so that any 32-bit word can be written signed or
+// unsigned. Anything wider is read as a value outside every field, for
+// imm_fits() to reject. The lexer splits on ' ', ',' and '#', so those
+// cannot be character literals.
+// Returns 0 on success, -1 if there is no literal.
+int imm_parse(const char *str, const char **end, int64_t *value);
+
+// Returns 1 if value fits in a field of bits, read as signed or unsigned
+int imm_fits(int64_t value, int bits, int is_signed);
+
+#endif /* IMMEDIATE_H_ */
@@ -0,0 +1,514 @@
+/*
+ * Copyright (C) 2021 Regents of University of Colorado
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lexer.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LEXER_X86
+#endif
+
+/* Private Helpers */
+
+static int is_delimiter(char c)
+{
+  return c == ' ' || c == ',' || c == '\t' || c == '\r';
+}
+
+/* Reads all of @fd into a heap buffer with one spare byte at the end. */
+static int read_whole(struct source *src, int fd, size_t size)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  src->buf = malloc(size + 1);
+  if (!src->buf) return -1;
+
+  while (done < size) {
+    n = read(fd, src->buf + done, size - done);
+    if (n <= 0) {
+      free(src->buf);
+      src->buf = NULL;
+      return -1;
+    }
+    done += n;
+  }
+  src->buf[size] = 0;
+  src->size = size;
+  src->mapped = 0;
+  return 0;
+}
+
+/* Starting size of the window a streamed source is read into */
+#define STREAM_WINDOW (1024 * 1024)
+
+static void push_token(struct lexer *lex, size_t start, size_t end)
+{
+  if (lex->ntoks == lex->cap) {
+    lex->cap = lex->cap ? lex->cap * 2 : 16;
+    lex->toks = realloc(lex->toks, lex->cap * sizeof(struct token));
+    assert(lex->toks);
+  }
+  lex->toks[lex->ntoks].offset = (uint32_t)start;
+  lex->toks[lex->ntoks].length = (uint32_t)(end - start);
+  lex->ntoks++;
+}
+
+/* Byte-at-a-time scan, the reference the vector kernels must agree with. */
+static size_t next_line_scalar(struct lexer *lex)
+{
+  const char *buf = lex->buf;
+  size_t pos = lex->pos, end = lex->size, start;
+  char c;
+
+  lex->ntoks = 0;
+
+  while (pos < end) {
+    c = buf[pos];
+
+    if (c == '\n') {
+      pos++;
+      if (lex->ntoks > 0) break;
+      continue;
+    }
+
+    if (is_delimiter(c)) {
+      pos++;
+      continue;
+    }
+
+    if (c == '#') {
+      while (pos < end && buf[pos] != '\n') pos++;
+      continue;
+    }
+
+    /* Start of a token, runs until a delimiter outside of quotes */
+    start = pos;
+    while (pos < end) {
+      c = buf[pos];
+      if (c == '\"') {
+        pos++;
+        while (pos < end && buf[pos] != '\"' && buf[pos] != '\n') pos++;
+        if (pos < end && buf[pos] == '\"') pos++;
+        continue;
+      }
+      if (is_delimiter(c) || c == '\n' || c == '#') break;
+      pos++;
+    }
+    push_token(lex, start, pos);
+  }
+
+  lex->pos = pos;
+  return lex->ntoks;
+}
+
+#ifdef LEXER_X86
+
+/*
+ * The vector kernels classify the source 64 bytes at a time into a bitmask
+ * per character class, turn those into masks of token starts, token ends and
+ * newlines, and then walk the set bits.
+ */
+
+#define BLOCK_SIZE (64)
+
+/* Character classes of one block, one bit per byte */
+struct block_classes {
+  uint64_t delim;       /* ' ', ',', '\t' and '\r' */
+  uint64_t newline;
+  uint64_t hash;
+  uint64_t quote;
+};
+
+typedef void (*classify_fn)(const char *p, struct block_classes *b);
+
+static inline uint64_t sse2_eq(__m128i v, char c)
+{
+  return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+static void classify_sse2(const char *p, struct block_classes *b)
+{
+  int i;
+  b->delim = b->newline = b->hash = b->quote = 0;
+  for (i = 0; i < BLOCK_SIZE; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    b->delim |= (sse2_eq(v, ' ') | sse2_eq(v, ',') |
+                 sse2_eq(v, '\t') | sse2_eq(v, '\r')) << i;
+    b->newline |= sse2_eq(v, '\n') << i;
+    b->hash |= sse2_eq(v, '#') << i;
+    b->quote |= sse2_eq(v, '\"') << i;
+  }
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t avx2_eq(__m256i v, char c)
+{
+  return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const char *p, struct block_classes *b)
+{
+  int i;
+  b->delim = b->newline = b->hash = b->quote = 0;
+  for (i = 0; i < BLOCK_SIZE; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    b->delim |= (avx2_eq(v, ' ') | avx2_eq(v, ',') |
+                 avx2_eq(v, '\t') | avx2_eq(v, '\r')) << i;
+    b->newline |= avx2_eq(v, '\n') << i;
+    b->hash |= avx2_eq(v, '#') << i;
+    b->quote |= avx2_eq(v, '\"') << i;
+  }
+}
+
+/* Bits @from (inclusive) up to @to (exclusive), 0 <= from <= to <= 64 */
+static inline uint64_t bit_range(unsigned from, unsigned to)
+{
+  uint64_t upto = to >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << to) - 1;
+  return upto & (~(uint64_t)0 << from);
+}
+
+/* Offset of the lowest set bit of @m, or 64 if there is none */
+static inline unsigned first_bit(uint64_t m)
+{
+  return m ? (unsigned)__builtin_ctzll(m) : 64;
+}
+
+/* Finds the boundaries of the next block of the source. */
+static inline void scan_block(struct lexer *lex, classify_fn classify)
+{
+  struct lexer_block *b = &lex->block;
+  struct block_classes cls;
+  uint64_t tok, comment = 0, string = 0, marks;
+  unsigned n = BLOCK_SIZE, at = 0, end;
+  const char *p = lex->buf + lex->pos;
+  char tail[BLOCK_SIZE];
+
+  b->base = lex->pos;
+
+  if (lex->size - lex->pos < BLOCK_SIZE) {
+    /* Pad the last partial block with delimiters, which end any token */
+    n = lex->size - lex->pos;
+    memset(tail, ' ', BLOCK_SIZE);
+    memcpy(tail, p, n);
+    p = tail;
+  }
+  lex->pos += n;
+
+  classify(p, &cls);
+
+  /*
+   * Comments run from '#' up to the next newline and strings from '"' up to
+   * the next '"' or newline. Each hides the other's opening character, so
+   * walk the few '#' and '"' in order, carrying a region open at the end of
+   * the block into the next one.
+   */
+  if (lex->in_comment) {
+    end = first_bit(cls.newline);
+    comment = bit_range(0, end);
+    lex->in_comment = (end == BLOCK_SIZE);
+    at = end;
+  } else if (lex->in_string) {
+    end = first_bit(cls.quote | cls.newline);
+    lex->in_string = (end == BLOCK_SIZE);
+    if (!lex->in_string && (cls.quote >> end & 1)) end++;
+    string = bit_range(0, end);
+    at = end;
+  }
+
+  marks = (cls.hash | cls.quote) & ~bit_range(0, at);
+  while (marks) {
+    at = __builtin_ctzll(marks);
+    if (cls.hash >> at & 1) {
+      end = first_bit(cls.newline & ~bit_range(0, at));
+      comment |= bit_range(at, end);
+      lex->in_comment = (end == BLOCK_SIZE);
+    } else {
+      end = first_bit((cls.quote | cls.newline) & ~bit_range(0, at + 1));
+      lex->in_string = (end == BLOCK_SIZE);
+      if (!lex->in_string && (cls.quote >> end & 1)) end++;
+      string |= bit_range(at, end);
+    }
+    marks &= ~bit_range(0, end);
+  }
+
+  tok = ((~(cls.delim | cls.newline | cls.hash) | string) & ~comment) &
+      bit_range(0, n);
+  b->starts = tok & ~((tok << 1) | (uint64_t)lex->in_token);
+  b->ends = ~tok & ((tok << 1) | (uint64_t)lex->in_token);
+  b->newlines = cls.newline & bit_range(0, n);
+  lex->in_token = (int)(tok >> 63);
+}
+
+/* Same tokens as next_line_scalar(), walking the boundary bitmasks. */
+static inline size_t next_line_blocks(struct lexer *lex, classify_fn classify)
+{
+  struct lexer_block *b = &lex->block;
+  uint64_t starts = b->starts, ends = b->ends, newlines = b->newlines;
+  uint64_t events, bit, done;
+  size_t at;
+
+  lex->ntoks = 0;
+
+  for (;;) {
+    events = starts | ends | newlines;
+    while (events) {
+      bit = events & -events;
+      events ^= bit;
+      at = b->base + __builtin_ctzll(bit);
+
+      /* A newline can also end a token, which has to come first */
+      if (ends & bit) push_token(lex, lex->tok_start, at);
+      if (starts & bit) lex->tok_start = at;
+      if ((newlines & bit) && lex->ntoks > 0) {
+        done = bit | (bit - 1);
+        b->starts = starts & ~done;
+        b->ends = ends & ~done;
+        b->newlines = newlines & ~done;
+        return lex->ntoks;
+      }
+    }
+
+    if (lex->pos >= lex->size) break;
+    scan_block(lex, classify);
+    starts = b->starts;
+    ends = b->ends;
+    newlines = b->newlines;
+  }
+
+  b->starts = b->ends = b->newlines = 0;
+
+  /* A token that runs to the very end of the source */
+  if (lex->in_token) {
+    lex->in_token = 0;
+    push_token(lex, lex->tok_start, lex->size);
+  }
+  return lex->ntoks;
+}
+
+static size_t next_line_sse2(struct lexer *lex)
+{
+  return next_line_blocks(lex, classify_sse2);
+}
+
+__attribute__((target("avx2")))
+static size_t next_line_avx2(struct lexer *lex)
+{
+  return next_line_blocks(lex, classify_avx2);
+}
+
+#endif /* LEXER_X86 */
+
+/* Public Interface */
+
+int source_open(struct source *src, const char *path)
+{
+  struct stat st;
+  long page = sysconf(_SC_PAGESIZE);
+  int fd, rv = 0;
+  void *map;
+
+  memset(src, 0, sizeof(*src));
+  src->fd = -1;
+  src->path = path;
+
+  fd = (strcmp(path, "-") == 0) ? STDIN_FILENO : open(path, O_RDONLY);
+  if (fd < 0) return -1;
+
+  if (fstat(fd, &st) < 0) {
+    if (fd != STDIN_FILENO) close(fd);
+    return -1;
+  }
+
+  /* No size to map, read it through a window as it arrives */
+  if (!S_ISREG(st.st_mode)) {
+    src->buf = malloc(STREAM_WINDOW);
+    if (!src->buf) {
+      if (fd != STDIN_FILENO) close(fd);
+      return -1;
+    }
+    src->buf[0] = 0;
+    src->cap = STREAM_WINDOW;
+    src->fd = fd;
+    return 0;
+  }
+
+  if (st.st_size > UINT32_MAX) {
+    if (fd != STDIN_FILENO) close(fd);
+    return -1;
+  }
+
+  if (st.st_size > 0 && st.st_size % page != 0) {
+    /* The rest of the last page reads as zeros and gives us a spare byte */
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      src->buf = map;
+      src->size = st.st_size;
+      src->mapped = 1;
+    } else {
+      rv = read_whole(src, fd, st.st_size);
+    }
+  } else {
+    rv = read_whole(src, fd, st.st_size);
+  }
+
+  if (fd != STDIN_FILENO) close(fd);
+  return rv;
+}
+
+ssize_t source_fill(struct source *src, size_t keep)
+{
+  size_t total = 0;
+  ssize_t n;
+  char *grown;
+
+  if (src->fd < 0) return 0;
+
+  memmove(src->buf, src->buf + keep, src->size - keep);
+  src->size -= keep;
+
+  /* Leave room for the spare byte after the text */
+  if (src->size + 1 >= src->cap) {
+    grown = realloc(src->buf, src->cap * 2);
+    if (!grown) return -1;
+    src->buf = grown;
+    src->cap *= 2;
+  }
+
+  while (src->size + 1 < src->cap) {
+    n = read(src->fd, src->buf + src->size, src->cap - 1 - src->size);
+    if (n < 0) return -1;
+    if (n == 0) {
+      if (src->fd != STDIN_FILENO) close(src->fd);
+      src->fd = -1;
+      break;
+    }
+    src->size += n;
+    total += n;
+  }
+  src->buf[src->size] = 0;
+
+  if (src->size > UINT32_MAX) return -1;
+  return total;
+}
+
+int source_read_all(struct source *src)
+{
+  ssize_t n;
+
+  while (src->fd >= 0) {
+    /* Keep everything, the buffer doubles whenever it is full */
+    n = source_fill(src, 0);
+    if (n < 0) return -1;
+  }
+  return 0;
+}
+
+void source_close(struct source *src)
+{
+  if (src->fd >= 0 && src->fd != STDIN_FILENO) close(src->fd);
+  src->fd = -1;
+
+  if (!src->buf) return;
+
+  if (src->mapped) {
+    munmap(src->buf, src->size);
+  } else {
+    free(src->buf);
+  }
+  src->buf = NULL;
+  src->size = 0;
+}
+
+void lexer_init(struct lexer *lex, struct source *src)
+{
+  memset(lex, 0, sizeof(*lex));
+  lex->buf = src->buf;
+  lex->size = src->size;
+  lexer_select(lex, LEXER_AUTO);
+}
+
+void lexer_init_range(struct lexer *lex, struct source *src, size_t begin,
+    size_t end)
+{
+  lexer_init(lex, src);
+  lex->pos = begin;
+  lex->size = end;
+}
+
+int lexer_select(struct lexer *lex, enum lexer_kernel kernel)
+{
+#ifdef LEXER_X86
+  int has_avx2;
+
+  __builtin_cpu_init();
+  has_avx2 = __builtin_cpu_supports("avx2");
+
+  /* AVX2 is no faster than SSE2 on real sources, and slower than scalar
+   * on some, so it is only used when asked for */
+  if (kernel == LEXER_AUTO) kernel = LEXER_SSE2;
+  if (kernel == LEXER_AVX2 && !has_avx2) return -1;
+#else
+  if (kernel == LEXER_AUTO) kernel = LEXER_SCALAR;
+  if (kernel != LEXER_SCALAR) return -1;
+#endif
+
+  lex->kernel = kernel;
+  lex->block.base = (size_t)-1;
+  return 0;
+}
+
+void lexer_free(struct lexer *lex)
+{
+  free(lex->toks);
+  lex->toks = NULL;
+  lex->ntoks = lex->cap = 0;
+}
+
+size_t lexer_next_line(struct lexer *lex)
+{
+  switch (lex->kernel) {
+#ifdef LEXER_X86
+  case LEXER_AVX2:
+    return next_line_avx2(lex);
+  case LEXER_SSE2:
+    return next_line_sse2(lex);
+#endif
+  default:
+    return next_line_scalar(lex);
+  }
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2021 Regents of University of Colorado
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LEXER_H_
+#define LEXER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A token is a slice of the source buffer, it is not copied anywhere. */
+struct token {
+  uint32_t offset;  /* Byte offset of the first character */
+  uint32_t length;  /* Number of bytes in the token */
+};
+
+/*
+ * An assembly source file held in memory for the whole parse, or a window
+ * onto a pipe that is read as parsing goes.
+ */
+struct source {
+  char *buf;        /* Contents, followed by at least one writable byte */
+  size_t size;      /* Bytes of source text in buf */
+  int mapped;       /* buf is an mmap of the file rather than a heap copy */
+  int fd;           /* Stream still being read by source_fill(), or -1 */
+  const char *path; /* Name it was opened by, not copied */
+  size_t cap;       /* Bytes allocated for buf while streaming */
+};
+
+/* Implementations of the scanning loop, they all produce the same tokens. */
+enum lexer_kernel {
+  LEXER_AUTO = 0,   /* SSE2 on x86, scalar elsewhere */
+  LEXER_SCALAR,     /* One byte at a time */
+  LEXER_SSE2,       /* Classifies 16 bytes per vector */
+  LEXER_AVX2,       /* Classifies 32 bytes per vector */
+};
+
+/* Token boundaries in one 64-byte block of the source, one bit per byte. */
+struct lexer_block {
+  size_t base;          /* Offset of the first byte of the block */
+  uint64_t starts;      /* First byte of a token */
+  uint64_t ends;        /* First byte after a token */
+  uint64_t newlines;    /* End of a line */
+};
+
+/* Splits a source into lines of tokens in one linear pass. */
+struct lexer {
+  const char *buf;
+  size_t size;          /* Scanning stops before this byte */
+  size_t pos;           /* Next byte to scan */
+  struct token *toks;   /* Tokens of the most recent line */
+  size_t ntoks;
+  size_t cap;
+  enum lexer_kernel kernel;
+  /* State of the vector kernels, carried from one block to the next */
+  struct lexer_block block;   /* Boundaries not yet turned into tokens */
+  size_t tok_start;           /* Start of the token being scanned */
+  int in_token, in_comment, in_string;
+};
+
+/**
+ * Maps the file named @path into @src, "-" stands for standard input.
+ *
+ * The mapping is private and writable so that consumers may terminate tokens
+ * in place. Files whose size is a multiple of the page size have no spare
+ * byte after the text and are read into a heap buffer instead.
+ *
+ * Pipes, terminals and other files that cannot be mapped are streamed: they
+ * are left open in src->fd and @src starts out empty, see source_fill().
+ *
+ * Returns 0 on success, -1 if an error occurred.
+ */
+int source_open(struct source *src, const char *path);
+
+/**
+ * Reads more of the streamed source @src. The bytes before @keep are done
+ * with and dropped, the rest move to the start of src->buf, which is then
+ * filled up as far as the stream allows. src->buf grows if nothing could be
+ * dropped, so a line never has to be split.
+ *
+ * Returns the number of bytes read, or 0 at the end of the stream, after
+ * which src->fd is -1. Returns -1 if an error occurred.
+ */
+ssize_t source_fill(struct source *src, size_t keep);
+
+/**
+ * Reads the rest of the streamed source @src, so that all of it is in
+ * src->buf. Does nothing for a source that is already in memory.
+ *
+ * Returns 0 on success, -1 if an error occurred.
+ */
+int source_read_all(struct source *src);
+
+/**
+ * Releases the memory held by @src.
+ */
+void source_close(struct source *src);
+
+/**
+ * Prepares @lex to scan @src from the beginning with the default kernel,
+ * see LEXER_AUTO.
+ */
+void lexer_init(struct lexer *lex, struct source *src);
+
+/**
+ * Prepares @lex to scan only the bytes [@begin, @end) of @src. Token offsets
+ * are still relative to the start of the source.
+ */
+void lexer_init_range(struct lexer *lex, struct source *src, size_t begin,
+    size_t end);
+
+/**
+ * Switches @lex to @kernel, for benchmarking and testing.
+ *
+ * Returns 0 on success, -1 if the CPU does not support @kernel.
+ */
+int lexer_select(struct lexer *lex, enum lexer_kernel kernel);
+
+/**
+ * Frees the token storage of @lex.
+ */
+void lexer_free(struct lexer *lex);
+
+/**
+ * Scans forward to the next line that has at least one token, skipping
+ * blank lines and comments. The tokens are left in lex->toks.
+ *
+ * Delimiters are spaces, tabs, commas and carriage returns. A '#' starts a
+ * comment that runs to the end of the line. A double quote starts a string
+ * in which delimiters and '#' are ordinary characters.
+ *
+ * Returns the number of tokens on the line, or 0 at the end of the source.
+ */
+size_t lexer_next_line(struct lexer *lex);
+
+#endif /* LEXER_H_ */
@@ -1,77 +1,356 @@
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
 
 #include "parser.h"
 #include "writer.h"
 #include "RISCV_32I_Assembler.h"
 #include "Linker.h"
+#include "object.h"
+#include "rvc.h"
 
 static void usage(char *name)
 {
-  printf("Usage: %s [input source]\n\
+  printf("Usage: %s [-c] [-j threads] [--rvc] [--text-base address]\n\
+\t[--data-base address] [--text-limit bytes] [--data-limit bytes]\n\
+\t[--gc-sections] [--merge-data] [--clobber-t1] [input]...\n\
 where:\n\
-\t[input source] is a file containing assembly source code.\n\
-", name);
+\t[-c] assembles each source to an object file, named after it with\n\
+\t\ta .o extension, to be linked later.\n\
+\t[-j threads] parses and encodes on this many threads (default 1).\n\
+\t[--rvc] emits 16-bit compressed instructions where possible.\n\
+\t[--text-base address] [--data-base address] load the segments at\n\
+\t\tthese word aligned addresses (default 0x%x and 0x%x).\n\
+\t[--text-limit bytes] [--data-limit bytes] are the largest the\n\
+\t\tsegments may be (default 0x%x and 0x%x).\n\
+\t[--gc-sections] drops the code and data that nothing reaches from\n\
+\t\tthe start of text or _start, going by labels.\n\
+\t[--merge-data] keeps equal data once, and strings that end others\n\
+\t\tas the end of them. Only for data that is never written.\n\
+\t[--clobber-t1] lets a branch or j that is out of reach by more than\n\
+\t\t1 MiB jump through t1, losing its value. Otherwise it is an error.\n\
+\t[input] is a file containing assembly source code, or - for\n\
+\t\tstandard input, or an object file. Several sources are assembled\n\
+\t\tas one program, in the order given, and objects are linked\n\
+\t\tafter it.\n\
+", name, TEXT_ADDRESS, DATA_ADDRESS, TEXT_LIMIT, DATA_LIMIT);
   exit(1);
 }
 
+// Long options, given values past any character
+enum {
+  OPT_RVC = 256,
+  OPT_TEXT_BASE,
+  OPT_DATA_BASE,
+  OPT_TEXT_LIMIT,
+  OPT_DATA_LIMIT,
+  OPT_GC_SECTIONS,
+  OPT_MERGE_DATA,
+  OPT_CLOBBER_T1,
+};
 
-int main( int argc, char *argv[] )
+static const struct option options[] = {
+  {"rvc", no_argument, NULL, OPT_RVC},
+  {"text-base", required_argument, NULL, OPT_TEXT_BASE},
+  {"data-base", required_argument, NULL, OPT_DATA_BASE},
+  {"text-limit", required_argument, NULL, OPT_TEXT_LIMIT},
+  {"data-limit", required_argument, NULL, OPT_DATA_LIMIT},
+  {"gc-sections", no_argument, NULL, OPT_GC_SECTIONS},
+  {"merge-data", no_argument, NULL, OPT_MERGE_DATA},
+  {"clobber-t1", no_argument, NULL, OPT_CLOBBER_T1},
+  {NULL, 0, NULL, 0},
+};
+
+// How sources are assembled, from the options
+struct settings {
+  int rvc;
+  uint32_t text_base, data_base;
+  size_t data_limit;
+};
+
+// Reads the 32-bit number of an option, decimal or 0x hex, or shows the
+// usage if it is not one
+static uint32_t number(char *name, const char *arg)
+{
+  unsigned long value;
+  char *end;
+
+  errno = 0;
+  value = strtoul(arg, &end, 0);
+  if (arg[0] < '0' || arg[0] > '9' || *end != 0 || errno != 0 ||
+      value > UINT32_MAX)
+    usage(name);
+  return (uint32_t)value;
+}
+
+
+// Parses and assembles the sources at paths into one program. With one
+// thread each line is assembled as soon as it is parsed, so the lines are
+// never all held in memory at once. Nothing assembled points into a source,
+// so each is closed once it is done. With a pool the text is encoded at the
+// end, and the sources stay open until then.
+static void assemble(char **paths, int num_paths, struct pool *pool,
+                     struct arena *arena, const struct settings *settings,
+                     int relocatable, struct sAssembledProgram *program)
 {
-  //First item in the linked list of "Line" structures
+  //First item in the linked list of "Line" structures (with -j)
   struct line* llh;
-  uint32_t *text_segment, *data_segment;
-  size_t prog_sz;
+  struct sAssembler assembler;
+  struct source *srcs;
+  int i;
 
-  // exit if arguments not enough
-  if ( argc < 2 ) usage(argv[0]);
+  assembler_init(&assembler);
+  assembler_set_compressed(&assembler, settings->rvc);
+  assembler_set_addresses(&assembler, settings->text_base, settings->data_base);
+  assembler_set_data_limit(&assembler, settings->data_limit);
+  assembler_set_relocatable(&assembler, relocatable);
+  if (pool) assembler_set_pool(&assembler, pool);
+
+  srcs = calloc(num_paths + 1, sizeof(struct source));
+  assert(srcs != NULL);
+  for (i = 0; i < num_paths; i++) {
+    struct source *src = &srcs[i];
+
+    // map the source, tokens are slices of it
+    if (source_open(src, paths[i]) != 0) {
+      fprintf(stderr, "Error opening file: %s\n", paths[i]);
+      exit(1);
+    }
+
+    if (pool) {
+      llh = get_lines_parallel(src, arena, pool);
+      if (!llh) {
+        fprintf(stderr, "Error getting the lines of file: %s\n", paths[i]);
+        exit(1);
+      }
+      //print_lines(llh);
+      for (; llh != NULL; llh = llh->next) {
+        if (assemble_line(llh, &assembler) != 0) {
+          fprintf(stderr, "Error assembling file: %s\n", paths[i]);
+          exit(1);
+        }
+      }
+    } else if (parse_source(src, assemble_line, &assembler) != 0) {
+      fprintf(stderr, "Error assembling file: %s\n", paths[i]);
+      exit(1);
+    }
 
-  // line header
-  llh = get_lines(argv[1]);
-  if (!llh) {
-    fprintf(stderr, "Error getting the lines of file: %s\n", argv[1]);
+    if (!pool) source_close(src);
+  }
+  if (assembler_finish(&assembler, program) != 0) {
+    fprintf(stderr, "Error assembling program\n");
     exit(1);
   }
+  if (pool) {
+    for (i = 0; i < num_paths; i++) source_close(&srcs[i]);
+  }
+  free(srcs);
+}
 
-  //print_lines(llh);
+// Name of the object of the source at path, its file name with the
+// extension replaced by .o. Standard input gives a.o.
+static char *object_name(const char *path)
+{
+  const char *base = strrchr(path, '/');
+  const char *dot;
+  size_t len;
+  char *name;
 
-  // allocate 32 bits (4 bytes) - 4 KiB of code/data
-  // text = instructions, data = data used by instructions
-  data_segment = malloc(sizeof(uint32_t)*DATA_SEGMENT_WORDS);
-  text_segment = malloc(sizeof(uint32_t)*TEXT_SEGMENT_WORDS);
+  base = base ? base + 1 : path;
+  if (strcmp(path, "-") == 0) base = "a";
+  dot = strrchr(base, '.');
+  len = (dot && dot != base) ? (size_t)(dot - base) : strlen(base);
 
-  // operating system failed to give memeory
-  if (data_segment == NULL || text_segment == NULL) {
-    fprintf(stderr, "Uh oh, looks like we ran out of memory!\n");
-    exit(1);
+  name = malloc(len + 3);
+  assert(name != NULL);
+  memcpy(name, base, len);
+  strcpy(name + len, ".o");
+  return name;
+}
+
+// Whether the input at path is an object rather than a source
+static int is_object(const char *path)
+{
+  return strcmp(path, "-") != 0 && object_probe(path);
+}
+
+int main( int argc, char *argv[] )
+{
+  struct sAssembledProgram program;
+  struct settings settings = {0, TEXT_ADDRESS, DATA_ADDRESS, DATA_LIMIT};
+  struct segment text, data;
+  struct arena arena;
+  struct pool *pool = NULL;
+  char **sources;
+  int threads = 1, compile = 0, gc_sections = 0, merge_data = 0, clobber_t1 = 0;
+  int num_sources = 0, opt, i;
+  size_t text_limit = TEXT_LIMIT;
+  uint8_t *text_segment;
+
+  while ((opt = getopt_long(argc, argv, "cj:", options, NULL)) != -1) {
+    switch (opt) {
+      case OPT_RVC:
+        settings.rvc = 1;
+        break;
+      case OPT_TEXT_BASE:
+        settings.text_base = number(argv[0], optarg);
+        break;
+      case OPT_DATA_BASE:
+        settings.data_base = number(argv[0], optarg);
+        break;
+      case OPT_TEXT_LIMIT:
+        text_limit = number(argv[0], optarg);
+        break;
+      case OPT_DATA_LIMIT:
+        settings.data_limit = number(argv[0], optarg);
+        break;
+      case OPT_GC_SECTIONS:
+        gc_sections = 1;
+        break;
+      case OPT_MERGE_DATA:
+        merge_data = 1;
+        break;
+      case OPT_CLOBBER_T1:
+        clobber_t1 = 1;
+        break;
+      case 'c':
+        compile = 1;
+        break;
+      case 'j':
+        threads = atoi(optarg);
+        if (threads < 1) usage(argv[0]);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  // exit if arguments not enough
+  if ( optind >= argc ) usage(argv[0]);
+  if (settings.text_base % 4 != 0 || settings.data_base % 4 != 0) usage(argv[0]);
+
+  // lines are all allocated from the arena
+  arena_init(&arena);
+  if (threads > 1) pool = pool_create(threads);
+
+  // Each source is an object of its own, nothing is linked
+  if (compile) {
+    for (i = optind; i < argc; i++) {
+      char *name = object_name(argv[i]);
+
+      if (is_object(argv[i])) {
+        fprintf(stderr, "Not a source: %s\n", argv[i]);
+        exit(1);
+      }
+      assemble(&argv[i], 1, pool, &arena, &settings, 1, &program);
+      if (object_write(name, &program) != 0) {
+        fprintf(stderr, "Error writing object: %s\n", name);
+        exit(1);
+      }
+      free(name);
+      program_free(&program);
+    }
+
+    arena_free(&arena);
+    include_cache_free();
+    symtab_free();
+    if (pool) pool_destroy(pool);
+    return 0;
+  }
+
+  // Assemble every source into the one program, then link in the objects.
+  // Sections move when others are dropped or merged, so nothing is placed
+  // yet.
+  sources = calloc(argc - optind, sizeof(char *));
+  assert(sources != NULL);
+  for (i = optind; i < argc; i++) {
+    if (!is_object(argv[i])) sources[num_sources++] = argv[i];
+  }
+  assemble(sources, num_sources, pool, &arena, &settings,
+           gc_sections || merge_data, &program);
+  free(sources);
+
+  for (i = optind; i < argc; i++) {
+    struct sAssembledProgram unit;
+
+    if (!is_object(argv[i])) continue;
+    if (object_read(argv[i], &unit) != 0) {
+      fprintf(stderr, "Error reading object: %s\n", argv[i]);
+      exit(1);
+    }
+    if (link_merge(&program, &unit) != 0) {
+      fprintf(stderr, "Error linking object: %s\n", argv[i]);
+      exit(1);
+    }
   }
 
-  //error
-  struct sAssembledProgram program = assemble_program(llh);
-  link_program(program, (uint8_t*)data_segment, (uint8_t*)text_segment);
+  if (gc_sections) link_gc(&program, symtab_intern("_start", 6));
+  if (merge_data) link_merge_data(&program);
 
+  // The segments are as large as the program, up to their limits
+  if (link_program(&program, text_limit, settings.data_limit, clobber_t1,
+                   &text_segment) != 0){
+    fprintf(stderr, "Error linking program\n");
+    exit(1);
+  }
+
+  // A row per label, with the bytes up to the next one. Labels merged
+  // into the same data get a row each, the last one holds the bytes.
   printf("%s\n", "DATA:");
-  for (struct sAssembledData *current = program.data; current != NULL; current = current->next){
-    printf("%s\t", current->label);
-    for (int i = 0; i < current->data_len; i++){
-      printf("%02x\t", current->data[i]);
+  size_t l = 0;
+  for (size_t i = 0; i < program.data_len; ){
+    uint32_t label = SYM_NONE;
+    size_t end = program.data_len;
+
+    while (l < program.num_data_labels && program.data_labels[l].offset <= i){
+      if (label != SYM_NONE) printf("%s\t\n", symtab_name(label));
+      label = program.data_labels[l++].label;
+    }
+    if (l < program.num_data_labels)
+      end = program.data_labels[l].offset;
+
+    printf("%s\t", symtab_name(label));
+    for (; i < end; i++){
+      printf("%02x\t", program.data[i]);
     }
     printf("\n");
   }
 
 printf("%s\n", "TEXT:");
-  for (struct sAssembledInstruction *current = program.text; current != NULL; current = current->next){
-    printf("%s\t%08x\n", current->label, current->binary);
+  l = 0;
+  for (size_t i = 0; i < program.text_len; ){
+    uint32_t label = SYM_NONE;
+
+    while (l < program.num_text_labels && program.text_labels[l].offset <= i * 2)
+      label = program.text_labels[l++].label;
+    if (RVC_IS_COMPRESSED(program.text[i])) {
+      printf("%s\t%04x\n", symtab_name(label), program.text[i]);
+      i += 1;
+    } else {
+      printf("%s\t%08x\n", symtab_name(label),
+        program.text[i] | (uint32_t)program.text[i + 1] << 16);
+      i += 2;
+    }
   }
 
-  prog_sz = write_program("a.mxe", text_segment, data_segment);
-  assert(prog_sz == DATA_SEGMENT_WORDS+TEXT_SEGMENT_WORDS);
+  text = (struct segment){program.text_address, text_segment, program.text_len * 2};
+  data = (struct segment){program.data_address, program.data, program.data_len};
+  if (write_program("a.mxe", &text, &data) < 0) {
+    fprintf(stderr, "Error writing program: a.mxe\n");
+    exit(1);
+  }
 
-  free_instructions(program.text);
-  free_data(program.data);
-  free_lines(llh);
+  free(text_segment);
+  program_free(&program);
+  arena_free(&arena);
+  include_cache_free();
+  symtab_free();
+  if (pool) pool_destroy(pool);
 
   return 0;
 }
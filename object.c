@@ -0,0 +1,323 @@
+/*
+ * Object files for CS4200 at UCCS, Fall 2021
+ *
+ *  PURPOSE: Save an assembled program before it is linked, so that sources
+             are assembled once and linked with the others as needed.
+ */
+
+#include "object.h"
+#include "Linker.h"
+#include "rvc.h"
+#include "symtab.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// Words of the header after the magic, see object.h
+enum eHeader {
+  H_TEXT_LEN,
+  H_DATA_LEN,
+  H_DATA_ALIGN,
+  H_NUM_SYMBOLS,
+  H_NUM_TEXT_LABELS,
+  H_NUM_DATA_LABELS,
+  H_NUM_FIXUPS,
+  NUM_HEADER,
+};
+
+
+/*------------ Words -------------*/
+static void _put_word(FILE *out, uint32_t word){
+  uint8_t bytes[4] = {(uint8_t)word, (uint8_t)(word >> 8), (uint8_t)(word >> 16),
+    (uint8_t)(word >> 24)};
+  fwrite(bytes, 1, 4, out);
+}
+
+static int _get_word(FILE *in, uint32_t *word){
+  uint8_t bytes[4];
+  if (fread(bytes, 1, 4, in) != 4)
+    return -1;
+  *word = bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 |
+    (uint32_t)bytes[3] << 24;
+  return 0;
+}
+
+// Zeros after len bytes, up to a word
+static void _put_pad(FILE *out, size_t len){
+  static const uint8_t zeros[4];
+  fwrite(zeros, 1, (4 - len % 4) % 4, out);
+}
+
+static int _get_pad(FILE *in, size_t len){
+  uint8_t bytes[4];
+  size_t pad = (4 - len % 4) % 4;
+  return fread(bytes, 1, pad, in) == pad ? 0 : -1;
+}
+
+
+/*------------ Writing -------------*/
+// Numbers id if it has no number yet. local is indexed by symbol ID and
+// holds its number plus one, ids the symbol of each number.
+static void _number(uint32_t id, uint32_t *local, uint32_t *ids, uint32_t *num_symbols){
+  if (local[id] == 0){
+    ids[*num_symbols] = id;
+    local[id] = ++*num_symbols;
+  }
+}
+
+int object_write(const char *path, const struct sAssembledProgram *program){
+  uint32_t count = symtab_count(), num_symbols = 0;
+  uint32_t *local = calloc(count, sizeof(uint32_t));
+  uint32_t *ids = malloc(count * sizeof(uint32_t));
+  FILE *out;
+  int status = 0;
+  assert(local != NULL && ids != NULL);
+
+  for (size_t i = 0; i < program->num_text_labels; i++)
+    _number(program->text_labels[i].label, local, ids, &num_symbols);
+  for (size_t i = 0; i < program->num_data_labels; i++)
+    _number(program->data_labels[i].label, local, ids, &num_symbols);
+  for (size_t i = 0; i < program->num_fixups; i++)
+    _number(program->fixups[i].target, local, ids, &num_symbols);
+
+  out = fopen(path, "wb");
+  if (out == NULL){
+    free(local);
+    free(ids);
+    return -1;
+  }
+
+  fwrite(OBJECT_MAGIC, 1, 4, out);
+  _put_word(out, (uint32_t)program->text_len);
+  _put_word(out, (uint32_t)program->data_len);
+  _put_word(out, program->data_align);
+  _put_word(out, num_symbols);
+  _put_word(out, (uint32_t)program->num_text_labels);
+  _put_word(out, (uint32_t)program->num_data_labels);
+  _put_word(out, (uint32_t)program->num_fixups);
+
+  for (size_t i = 0; i < program->text_len; i++){
+    uint8_t bytes[2] = {(uint8_t)program->text[i], (uint8_t)(program->text[i] >> 8)};
+    fwrite(bytes, 1, 2, out);
+  }
+  _put_pad(out, program->text_len * 2);
+  if (program->data_len > 0)
+    fwrite(program->data, 1, program->data_len, out);
+  _put_pad(out, program->data_len);
+
+  for (uint32_t i = 0; i < num_symbols; i++){
+    const char *name = symtab_name(ids[i]);
+    size_t len = strlen(name);
+    _put_word(out, (uint32_t)len);
+    fwrite(name, 1, len, out);
+    _put_pad(out, len);
+  }
+
+  for (size_t i = 0; i < program->num_text_labels; i++){
+    _put_word(out, local[program->text_labels[i].label] - 1);
+    _put_word(out, program->text_labels[i].offset);
+  }
+  for (size_t i = 0; i < program->num_data_labels; i++){
+    _put_word(out, local[program->data_labels[i].label] - 1);
+    _put_word(out, program->data_labels[i].offset);
+  }
+  for (size_t i = 0; i < program->num_fixups; i++){
+    _put_word(out, program->fixups[i].offset);
+    _put_word(out, local[program->fixups[i].target] - 1);
+    _put_word(out, (uint32_t)program->fixups[i].linker_code);
+  }
+
+  if (ferror(out))
+    status = -1;
+  if (fclose(out) != 0)
+    status = -1;
+  free(local);
+  free(ids);
+  return status;
+}
+
+
+/*------------ Reading -------------*/
+// Reads num labels of segment into labels, and defines them in program.
+// A label is defined once, at an offset inside its segment.
+static int _read_labels(FILE *in, struct sAssembledProgram *program,
+  enum eAssemblerState segment, const uint32_t *ids, uint32_t num_symbols,
+  struct sLabel *labels, size_t num){
+
+  size_t end = segment == S_TEXT ? program->text_len * 2 : program->data_len;
+
+  for (size_t i = 0; i < num; i++){
+    uint32_t symbol, offset;
+    struct sDefinition *definition;
+
+    if (_get_word(in, &symbol) != 0 || _get_word(in, &offset) != 0 ||
+        symbol >= num_symbols || offset > end)
+      return -1;
+    definition = &program->definitions[ids[symbol]];
+    if (definition->address != ADDRESS_UNDEFINED)
+      return -1;
+
+    labels[i] = (struct sLabel){.label = ids[symbol], .offset = offset};
+    definition->segment = segment;
+    if (segment == S_TEXT){
+      definition->address = program->text_address + offset;
+      definition->text_len = offset / 2;
+    } else {
+      definition->address = program->data_address + offset;
+      definition->text_len = 0;
+    }
+  }
+  return 0;
+}
+
+// Whether a fixup of linker_code can be on the instruction at offset. A
+// compressed one must be the jump or branch it is filled in as.
+static int _fixup_fits(const struct sAssembledProgram *program, uint32_t offset,
+  uint32_t linker_code){
+
+  uint32_t binary;
+
+  if (!RVC_IS_COMPRESSED(program->text[offset]))
+    return offset + 1 < program->text_len;
+  binary = rvc_expand(program->text[offset]);
+  return (linker_code == LINKER_JAL && (binary & 0x7F) == 0x6F) ||
+    (linker_code == LINKER_BRANCH && (binary & 0x7F) == 0x63);
+}
+
+// Reads the object after its magic into program, which is zeroed. Any
+// count larger than the file is refused before it is allocated.
+static int _read(FILE *in, long size, struct sAssembledProgram *program){
+  uint32_t header[NUM_HEADER];
+  uint32_t *ids, num_symbols, count;
+  int status = 0;
+
+  for (int i = 0; i < NUM_HEADER; i++){
+    if (_get_word(in, &header[i]) != 0 || (i != H_DATA_ALIGN && header[i] > (uint32_t)size))
+      return -1;
+  }
+  if ((header[H_DATA_ALIGN] & (header[H_DATA_ALIGN] - 1)) != 0 ||
+      header[H_DATA_ALIGN] > (uint32_t)1 << MAX_ALIGN)
+    return -1;
+  num_symbols = header[H_NUM_SYMBOLS];
+
+  // where the object would be loaded on its own, link_merge() moves it
+  program->text_address = TEXT_ADDRESS;
+  program->data_address = DATA_ADDRESS;
+
+  program->text_len = program->text_cap = header[H_TEXT_LEN];
+  program->data_len = program->data_cap = header[H_DATA_LEN];
+  program->data_align = header[H_DATA_ALIGN];
+  program->num_text_labels = program->cap_text_labels = header[H_NUM_TEXT_LABELS];
+  program->num_data_labels = program->cap_data_labels = header[H_NUM_DATA_LABELS];
+  program->num_fixups = program->cap_fixups = header[H_NUM_FIXUPS];
+  program->text = malloc(program->text_len * sizeof(uint16_t) + 1);
+  program->data = malloc(program->data_len + 1);
+  program->text_labels = malloc(program->num_text_labels * sizeof(struct sLabel) + 1);
+  program->data_labels = malloc(program->num_data_labels * sizeof(struct sLabel) + 1);
+  program->fixups = malloc(program->num_fixups * sizeof(struct sFixup) + 1);
+  assert(program->text != NULL && program->data != NULL && program->fixups != NULL &&
+    program->text_labels != NULL && program->data_labels != NULL);
+
+  /*------------ Text and data -------------*/
+  for (size_t i = 0; i < program->text_len; i++){
+    uint8_t bytes[2];
+    if (fread(bytes, 1, 2, in) != 2)
+      return -1;
+    program->text[i] = bytes[0] | (uint16_t)(bytes[1] << 8);
+  }
+  if (_get_pad(in, program->text_len * 2) != 0 ||
+      fread(program->data, 1, program->data_len, in) != program->data_len ||
+      _get_pad(in, program->data_len) != 0)
+    return -1;
+
+  /*------------ Symbols -------------*/
+  // interned again, so they take the IDs of this run
+  ids = malloc(num_symbols * sizeof(uint32_t) + 1);
+  assert(ids != NULL);
+  for (uint32_t i = 0; i < num_symbols && status == 0; i++){
+    char *name;
+    uint32_t len;
+
+    if (_get_word(in, &len) != 0 || len == 0 || len > (uint32_t)size){
+      status = -1;
+      break;
+    }
+    name = malloc(len);
+    assert(name != NULL);
+    if (fread(name, 1, len, in) != len || _get_pad(in, len) != 0 ||
+        memchr(name, 0, len) != NULL)
+      status = -1;
+    else
+      ids[i] = symtab_intern(name, len);
+    free(name);
+  }
+
+  /*------------ Labels and fixups -------------*/
+  count = symtab_count();
+  program->definitions = malloc(count * sizeof(struct sDefinition));
+  assert(program->definitions != NULL);
+  program->num_definitions = count;
+  memset(program->definitions, 0xFF, count * sizeof(struct sDefinition));
+
+  if (status == 0)
+    status = _read_labels(in, program, S_TEXT, ids, num_symbols,
+      program->text_labels, program->num_text_labels);
+  if (status == 0)
+    status = _read_labels(in, program, S_DATA, ids, num_symbols,
+      program->data_labels, program->num_data_labels);
+
+  // in order of offset, each on an instruction that fits in text
+  for (size_t i = 0; i < program->num_fixups && status == 0; i++){
+    uint32_t offset, symbol, linker_code;
+
+    if (_get_word(in, &offset) != 0 || _get_word(in, &symbol) != 0 ||
+        _get_word(in, &linker_code) != 0 || symbol >= num_symbols ||
+        linker_code == LINKER_NONE || linker_code > LINKER_LA_ADDI ||
+        offset >= program->text_len ||
+        (i > 0 && offset <= program->fixups[i - 1].offset) ||
+        !_fixup_fits(program, offset, linker_code)){
+      status = -1;
+      break;
+    }
+    program->fixups[i] = (struct sFixup){.offset = offset, .target = ids[symbol],
+      .linker_code = (enum eLinkerCode)linker_code};
+  }
+
+  free(ids);
+  return status;
+}
+
+int object_read(const char *path, struct sAssembledProgram *program){
+  FILE *in = fopen(path, "rb");
+  char magic[4];
+  long size;
+  int status = -1;
+
+  memset(program, 0, sizeof(struct sAssembledProgram));
+  if (in == NULL)
+    return -1;
+
+  if (fseek(in, 0, SEEK_END) == 0 && (size = ftell(in)) >= 0 &&
+      fseek(in, 0, SEEK_SET) == 0 && fread(magic, 1, 4, in) == 4 &&
+      memcmp(magic, OBJECT_MAGIC, 4) == 0)
+    status = _read(in, size, program);
+
+  fclose(in);
+  if (status != 0)
+    program_free(program);
+  return status;
+}
+
+int object_probe(const char *path){
+  FILE *in = fopen(path, "rb");
+  char magic[4];
+  int is_object;
+
+  if (in == NULL)
+    return 0;
+  is_object = fread(magic, 1, 4, in) == 4 && memcmp(magic, OBJECT_MAGIC, 4) == 0;
+  fclose(in);
+  return is_object;
+}
@@ -0,0 +1,38 @@
+/*
+ * Object files for CS4200 at UCCS, Fall 2021
+ *
+ *  PURPOSE: Save an assembled program before it is linked, so that sources
+             are assembled once and linked with the others as needed.
+ */
+
+#ifndef OBJECT_H_
+#define OBJECT_H_
+
+#include <stdint.h>
+#include "RISCV_32I_Assembler.h"
+
+// An object file starts with these 4 bytes
+#define OBJECT_MAGIC "MXO1"
+
+// Layout of an object file, every number a 32-bit little endian word:
+//   magic, text_len, data_len, data_align, num_symbols, num_text_labels,
+//   num_data_labels, num_fixups
+//   text, in halfwords, then data, padded with zeros to a word
+//   symbols, each as its length then its name padded with zeros to a word
+//   labels, text then data, each as a symbol and its byte offset
+//   fixups, each as its halfword offset, symbol and eLinkerCode
+// Symbols are numbered in the order they are written, names are interned
+// again when the object is read.
+
+// Writes program, which is not linked yet, to path. Returns 0, or -1 if
+// it could not be written.
+int object_write(const char *path, const struct sAssembledProgram *program);
+
+// Reads the object at path into program, released with program_free().
+// Returns 0, or -1 if it could not be read or is not a valid object.
+int object_read(const char *path, struct sAssembledProgram *program);
+
+// Returns 1 if path is an object file rather than a source
+int object_probe(const char *path);
+
+#endif /* OBJECT_H_ */
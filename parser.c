@@ -32,6 +32,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define DEBUG
 
@@ -39,14 +42,12 @@
 
 /* Private Helpers */
 
-/* delimiters between tokens in the assembly syntax */
-#define DELIMITERS " ,\t"
-
-#define NUM_DIRECTIVES (6)
+#define NUM_DIRECTIVES (7)
 char *directives[NUM_DIRECTIVES] = {
   ".align",
   ".asciiz",
   ".data",
+  ".include",
   ".space",
   ".text",
   ".word"
@@ -90,158 +91,815 @@ char *instructions[NUM_INSTS] = {
   "ret"
 };
 
+/**
+ * Maps the token @s of @len bytes to its linetype with an exact match.
+ *
+ * Dispatches on the length and first character, so at most a couple of
+ * candidates are compared whatever the token is.
+ *
+ * Returns the linetype or -1 if the token is not a directive or instruction.
+ */
+static int classify(const char *s, size_t len)
+{
+#define MATCH(str, type) if (memcmp(s, str, len) == 0) return (type)
+  switch (len) {
+  case 1:
+    switch (s[0]) {
+    case 'j':
+      MATCH("j", INST_J);
+      break;
+    }
+    break;
+  case 2:
+    switch (s[0]) {
+    case 'l':
+      MATCH("lw", INST_LW);
+      MATCH("la", INST_LA);
+      MATCH("li", INST_LI);
+      break;
+    case 'm':
+      MATCH("mv", INST_MV);
+      break;
+    case 'o':
+      MATCH("or", INST_OR);
+      break;
+    case 's':
+      MATCH("sw", INST_SW);
+      break;
+    }
+    break;
+  case 3:
+    switch (s[0]) {
+    case 'a':
+      MATCH("add", INST_ADD);
+      MATCH("and", INST_AND);
+      break;
+    case 'b':
+      MATCH("beq", INST_BEQ);
+      MATCH("bne", INST_BNE);
+      break;
+    case 'j':
+      MATCH("jal", INST_JAL);
+      break;
+    case 'l':
+      MATCH("lui", INST_LUI);
+      break;
+    case 'n':
+      MATCH("neg", INST_NEG);
+      MATCH("nop", INST_NOP);
+      MATCH("not", INST_NOT);
+      break;
+    case 'o':
+      MATCH("ori", INST_ORI);
+      break;
+    case 'r':
+      MATCH("ret", INST_RET);
+      break;
+    case 's':
+      MATCH("slt", INST_SLT);
+      MATCH("sll", INST_SLL);
+      MATCH("sra", INST_SRA);
+      MATCH("srl", INST_SRL);
+      MATCH("sub", INST_SUB);
+      break;
+    case 'x':
+      MATCH("xor", INST_XOR);
+      break;
+    }
+    break;
+  case 4:
+    switch (s[0]) {
+    case 'a':
+      MATCH("addi", INST_ADDI);
+      MATCH("andi", INST_ANDI);
+      break;
+    case 'j':
+      MATCH("jalr", INST_JALR);
+      break;
+    case 's':
+      MATCH("slti", INST_SLTI);
+      MATCH("slli", INST_SLLI);
+      MATCH("srai", INST_SRAI);
+      MATCH("srli", INST_SRLI);
+      break;
+    case 'x':
+      MATCH("xori", INST_XORI);
+      break;
+    }
+    break;
+  case 5:
+    switch (s[0]) {
+    case '.':
+      MATCH(".data", DATA);
+      MATCH(".text", TEXT);
+      MATCH(".word", WORD);
+      break;
+    case 'a':
+      MATCH("auipc", INST_AUIPC);
+      break;
+    }
+    break;
+  case 6:
+    switch (s[0]) {
+    case '.':
+      MATCH(".align", ALIGN);
+      MATCH(".space", SPACE);
+      break;
+    }
+    break;
+  case 7:
+    switch (s[0]) {
+    case '.':
+      MATCH(".asciiz", ASCIIZ);
+      break;
+    }
+    break;
+  case 8:
+    switch (s[0]) {
+    case '.':
+      MATCH(".include", INCLUDE);
+      break;
+    }
+    break;
+  }
+#undef MATCH
+  return -1;
+}
+
+
+/* Lines parsed from the byte range [begin, end) of a source */
+struct parse_chunk {
+  struct source *src;
+  size_t begin, end;
+  int copy;             /* Copy tokens out instead of terminating in place */
+  struct arena arena;   /* Owns the lines when parsed on a worker thread */
+  struct line *head, *tail;
+  struct token_buffer *tokens;  /* Tokens of the lines */
+  size_t text_cap;      /* Size of tokens->text when tokens are copied */
+  uint32_t label;       /* Label still waiting for a line at the end */
+  size_t includes;      /* Number of .include lines among the lines */
+  char *error;          /* Unrecognized symbol that stopped the chunk */
+};
+
+/* Chunks smaller than this are not worth handing to another thread */
+#define MIN_CHUNK_BYTES (64 * 1024)
+
+/* How much of the source parse_source() consumes before dropping it */
+#define RELEASE_BYTES (1024 * 1024)
 
-void free_token_list(struct token_node *token_listhead)
+/* Tokens a buffer starts out with room for */
+#define MIN_TOKENS (64)
+
+/**
+ * Appends a token of @length bytes at @offset in tb->text to @tb.
+ *
+ * Returns the index of the token.
+ */
+static uint32_t token_buffer_push(struct token_buffer *tb, uint32_t offset,
+    uint32_t length)
 {
-  struct token_node *curr = token_listhead, *next;
+  if (tb->count == tb->cap) {
+    tb->cap = tb->cap ? tb->cap * 2 : MIN_TOKENS;
+    tb->offset = realloc(tb->offset, tb->cap * sizeof(uint32_t));
+    tb->length = realloc(tb->length, tb->cap * sizeof(uint32_t));
+    assert(tb->offset && tb->length);
+  }
+  tb->offset[tb->count] = offset;
+  tb->length[tb->count] = length;
+  return (uint32_t)tb->count++;
+}
 
-  while (curr != NULL) {
-    next = curr->next;
-    free(curr);
-    curr = next;
+/**
+ * Moves the token arrays of @tb into @arena once no more tokens are coming,
+ * so that they are released along with the lines.
+ */
+static void token_buffer_settle(struct token_buffer *tb, struct arena *arena)
+{
+  uint32_t *offset = arena_malloc(arena, tb->count * sizeof(uint32_t));
+  uint32_t *length = arena_malloc(arena, tb->count * sizeof(uint32_t));
+
+  memcpy(offset, tb->offset, tb->count * sizeof(uint32_t));
+  memcpy(length, tb->length, tb->count * sizeof(uint32_t));
+  free(tb->offset);
+  free(tb->length);
+  tb->offset = offset;
+  tb->length = length;
+  tb->cap = tb->count;
+}
+
+/* Returns the offset just past the last newline in @buf, or 0 if none */
+static size_t complete_lines(const char *buf, size_t size)
+{
+  while (size > 0 && buf[size - 1] != '\n') size--;
+  return size;
+}
+
+/**
+ * Copies the tokens @toks[@first..@ntoks) of @buf into chunk->tokens, which
+ * holds the tokens of this one line only. The span of the line is copied in
+ * one go and the delimiter after each token is overwritten with a NUL.
+ */
+static void copy_tokens(struct parse_chunk *chunk, const char *buf,
+    struct token *toks, size_t first, size_t ntoks)
+{
+  struct token_buffer *tb = chunk->tokens;
+  uint32_t base = toks[first].offset;
+  size_t span = toks[ntoks - 1].offset + toks[ntoks - 1].length - base;
+  size_t t;
+
+  if (span + 1 > chunk->text_cap) {
+    while (span + 1 > chunk->text_cap)
+      chunk->text_cap = chunk->text_cap ? chunk->text_cap * 2 : 256;
+    tb->text = realloc(tb->text, chunk->text_cap);
+    assert(tb->text);
+  }
+  memcpy(tb->text, &buf[base], span);
+
+  tb->count = 0;
+  for (t = first; t < ntoks; t++) {
+    tb->text[toks[t].offset - base + toks[t].length] = 0;
+    token_buffer_push(tb, toks[t].offset - base, toks[t].length);
+  }
+}
+
+/**
+ * Returns the string of token @tok of @buf. The lexer is done with the whole
+ * line by now, so the delimiter after the token can be overwritten to
+ * terminate it in place. When @copy is set the token is copied into @arena.
+ */
+static char* token_string(char *buf, struct token *tok, int copy,
+    struct arena *arena)
+{
+  char *str;
+
+  if (!copy) {
+    buf[tok->offset + tok->length] = 0;
+    return &buf[tok->offset];
   }
+
+  str = arena_malloc(arena, tok->length + 1);
+  memcpy(str, &buf[tok->offset], tok->length);
+  str[tok->length] = 0;
+  return str;
 }
 
-static void strip_comments(char *s, size_t len)
+/**
+ * Returns the index of the token of a line of @type with @ntoks tokens,
+ * counting the mnemonic, that names the label it refers to, or 0 if none.
+ */
+static size_t target_token(linetype type, size_t ntoks)
 {
-  int i;
-  for (i = 0; i < len; i++) {
-    if (s[i] == '#') s[i] = 0;
-    if (s[i] == 0) break;
+  switch (type) {
+  case INST_BEQ:
+  case INST_BNE:
+    return ntoks > 3 ? 3 : 0;
+  case INST_JAL:
+    /* The return register may be left out */
+    return ntoks > 2 ? 2 : (ntoks > 1 ? 1 : 0);
+  case INST_J:
+    return ntoks > 1 ? 1 : 0;
+  case INST_LA:
+    return ntoks > 2 ? 2 : 0;
+  default:
+    return 0;
   }
 }
 
 /**
- * Reads the next line from the file stream @in.
+ * Reads the next line from the lexer @lex scanning the source buffer @buf.
+ *
+ * Tokens are terminated in place in @buf and appended to chunk->tokens, so
+ * token strings point into the source and nothing is copied, unless
+ * chunk->copy is set; then the tokens of the line are copied into
+ * chunk->tokens and @buf is left untouched. The line is bump allocated from
+ * @arena. Labels and the label operand of the line are interned, without
+ * the colon of a label definition.
+ *
+ * A label on a line of its own is kept in @chunk until the next line; if
+ * several come in a row only the last is kept.
  *
- * Returns an allocated line or NULL if no more lines or error occured.
+ * Returns an allocated line or NULL if no more lines or error occured, in
+ * which case chunk->error is set.
  */
-static struct line* get_next_line(FILE *in)
+static struct line* get_next_line(struct lexer *lex, char *buf,
+    struct parse_chunk *chunk, struct arena *arena)
 {
-  int i, sh;
-  unsigned int end;
-  struct line* next = calloc(1, sizeof(struct line));
-  struct token_node *tn, *curr;
-  char *linebuf = NULL;
-  size_t linesz = 0;
-  char *token = NULL;
+  int type;
+  size_t ntoks, first, t, target;
+  struct line* next;
+  struct token *toks;
+  struct token_buffer *tb = chunk->tokens;
+
+  /* Find start of the next line and pick up label if any */
+  for (;;) {
+    ntoks = lexer_next_line(lex);
+    if (ntoks == 0) return NULL;
+    toks = lex->toks;
+    first = 0;
+
+    /* Check for a label. Only keep one label. */
+    if (buf[toks[0].offset + toks[0].length - 1] == ':') {
+      chunk->label = symtab_intern(&buf[toks[0].offset], toks[0].length - 1);
+      first = 1;
+    }
+    if (first < ntoks) break;
+  }
+
+  /* Check for assembler directives and instructions */
+  type = classify(&buf[toks[first].offset], toks[first].length);
+
+  /* Error if token is not a directive or instruction. */
+  if (type < 0) {
+    chunk->error = token_string(buf, &toks[first], chunk->copy, arena);
+    return NULL;
+  }
 
+  next = arena_calloc(arena, 1, sizeof(struct line));
 #ifdef DEBUG
   assert(next);
 #endif
-  if (!next) return NULL;
-
-  /* Find start of the next line. Eat whitespace and pick up label if any */
-  while (token == NULL) {
-    if (linebuf) {
-      free(linebuf);
-      linebuf = NULL;
-      linesz = 0;
-    }
-    if (getline(&linebuf, &linesz, in) <= 0) {
-      free(next);
-      return NULL;
+  next->type = (linetype)type;
+  if (type == INCLUDE) chunk->includes++;
+  next->label = chunk->label;
+  chunk->label = SYM_NONE;
+
+  target = target_token(next->type, ntoks - first);
+  if (target) {
+    target += first;
+    next->target = symtab_intern(&buf[toks[target].offset], toks[target].length);
+  }
+
+  next->tokens = tb;
+  next->num_tokens = (uint32_t)(ntoks - first);
+  if (chunk->copy) {
+    copy_tokens(chunk, buf, toks, first, ntoks);
+    next->first_token = 0;
+    return next;
+  }
+
+  next->first_token = (uint32_t)tb->count;
+  for (t = first; t < ntoks; t++) {
+    buf[toks[t].offset + toks[t].length] = 0;
+    token_buffer_push(tb, toks[t].offset, toks[t].length);
+  }
+
+  return next;
+}
+
+/* Parses the lines of @chunk into a list allocated from @arena */
+static void parse_chunk(struct parse_chunk *chunk, struct arena *arena)
+{
+  struct lexer lex;
+  struct line *next;
+
+  /* All lines of the chunk share one buffer of tokens in the source */
+  chunk->tokens = arena_calloc(arena, 1, sizeof(struct token_buffer));
+  chunk->tokens->text = chunk->src->buf;
+
+  lexer_init_range(&lex, chunk->src, chunk->begin, chunk->end);
+  while ((next = get_next_line(&lex, chunk->src->buf, chunk, arena)) != NULL) {
+    if (chunk->tail) {
+      chunk->tail->next = next;
+    } else {
+      chunk->head = next;
     }
-    end = strnlen(linebuf, linesz);
-    while (end > 0 && (linebuf[end-1] == '\n' || linebuf[end-1] == '\r')) {
-      linebuf[--end] = 0; // eat newline
+    chunk->tail = next;
+  }
+  lexer_free(&lex);
+  token_buffer_settle(chunk->tokens, arena);
+}
+
+/* Pool task: parses one chunk into the chunk's own arena */
+static void parse_chunk_task(void *ctx, size_t i)
+{
+  struct parse_chunk *chunk = &((struct parse_chunk *)ctx)[i];
+  parse_chunk(chunk, &chunk->arena);
+}
+
+/**
+ * Joins the line lists of @chunks in source order, giving the same list a
+ * single chunk would have: a label left waiting at the end of a chunk goes
+ * to the first line of a later one.
+ *
+ * Returns NULL if any chunk stopped at an error.
+ */
+static struct line* stitch_chunks(struct parse_chunk *chunks, size_t n)
+{
+  struct line *head = NULL, *tail = NULL;
+  uint32_t label = SYM_NONE;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (chunks[i].head) {
+      if (!chunks[i].head->label) chunks[i].head->label = label;
+      if (tail) {
+        tail->next = chunks[i].head;
+      } else {
+        head = chunks[i].head;
+      }
+      tail = chunks[i].tail;
+      label = chunks[i].label;
+    } else if (chunks[i].label) {
+      label = chunks[i].label;
     }
-    strip_comments(linebuf, linesz);
-    token = strtok(linebuf, DELIMITERS);
 
-    /* Check for a label. Only keep one label. */
-    if (token && token[strlen(token)-1] == ':') {
-      if (next->label) free(next->label);
-      next->label = strdup(token);
-      token = strtok(NULL, DELIMITERS);
+    if (chunks[i].error) {
+      fprintf(stderr, "Parser error, unrecognized symbol: %s\n",
+          chunks[i].error);
+      return NULL;
     }
   }
 
-  /* Check for assembler directives */
-  for (i = 0; i < NUM_DIRECTIVES; i++) {
-    if (strncmp(token, directives[i], sizeof(directives[i])) == 0) {
-      next->type = (linetype)i;
-      break;
-    }
+  return head;
+}
+
+/* A file read for .include, parsed once and replayed wherever included */
+struct include_file {
+  char *path;           /* Path it was opened by */
+  off_t size;           /* Size and modification time when it was parsed */
+  time_t mtime;
+  struct source src;    /* Kept open, the tokens point into it */
+  struct arena arena;   /* Owns the lines */
+  struct line *head;
+  uint32_t label;       /* Label left waiting at the end of the file */
+  struct include_file *next;
+};
+
+/*
+ * Files parsed for .include so far, newest first. An entry that has gone
+ * stale stays in the list, lines handed out earlier may still use it.
+ */
+static struct include_file *include_cache;
+
+/* Nesting deeper than this is taken to be a file including itself */
+#define MAX_INCLUDE_DEPTH (32)
+
+/* Collects lines handed over by replay_include() into a list */
+struct line_list {
+  struct arena *arena;
+  struct line *head, *tail;
+};
+
+/**
+ * Returns the path of the file named by the .include line @line of the
+ * source @includer, which relative paths start from the directory of. The
+ * file name may be in quotes. The path is allocated with malloc().
+ */
+static char* include_path(const struct line *line, const char *includer)
+{
+  const char *name = line_token(line, 1);
+  size_t len = line_token_length(line, 1);
+  const char *slash = includer ? strrchr(includer, '/') : NULL;
+  size_t dir = 0;
+  char *path;
+
+  if (len >= 2 && name[0] == '\"' && name[len - 1] == '\"') {
+    name++;
+    len -= 2;
   }
+  if (len > 0 && name[0] != '/' && slash) dir = slash - includer + 1;
+
+  path = malloc(dir + len + 1);
+  assert(path);
+  memcpy(path, includer, dir);
+  memcpy(path + dir, name, len);
+  path[dir + len] = 0;
+  return path;
+}
 
-  if (i == NUM_DIRECTIVES) {
-    /* Check for instructions */
-    for (i = 0; i < NUM_INSTS; i++) {
-      if (strncmp(token, instructions[i], sizeof(instructions[i])) == 0) {
-        next->type = NUM_DIRECTIVES + i;
-        break;
-      }
+/**
+ * Returns the parsed lines of the file at @path, from the cache if the file
+ * has the same size and modification time as when it was cached, otherwise
+ * parsing it and caching the result.
+ *
+ * Returns NULL if the file cannot be read or parsed.
+ */
+static struct include_file* include_lookup(const char *path)
+{
+  struct include_file *file;
+  struct parse_chunk chunk;
+  struct stat st;
+
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "Parser error, cannot include file: %s\n", path);
+    return NULL;
+  }
+
+  for (file = include_cache; file != NULL; file = file->next) {
+    if (file->size == st.st_size && file->mtime == st.st_mtime &&
+        strcmp(file->path, path) == 0) {
+      return file;
     }
   }
 
-  /* Error if token is not a directive or instruction. */
-  if (i == NUM_INSTS) {
-    fprintf(stderr, "Parser error, unrecognized symbol: %s\n", token);
-    free(linebuf);
-    free(next);
+  file = calloc(1, sizeof(struct include_file));
+  assert(file);
+  file->path = strdup(path);
+  assert(file->path);
+  file->size = st.st_size;
+  file->mtime = st.st_mtime;
+  arena_init(&file->arena);
+
+  if (source_open(&file->src, file->path) != 0 ||
+      source_read_all(&file->src) != 0) {
+    fprintf(stderr, "Parser error, cannot include file: %s\n", path);
+    source_close(&file->src);
+    free(file->path);
+    free(file);
     return NULL;
   }
 
-  next->token_listhead = malloc(sizeof(struct token_node));
-  assert(next->token_listhead);
-  curr = next->token_listhead;
-  curr->token = strdup(token);
-  curr->next = NULL;
-
-  while ((token = strtok(NULL, DELIMITERS)) != NULL) {
-    tn = malloc(sizeof(struct token_node));
-    assert(tn);
-    tn->token = strdup(token);
-    tn->next = NULL;
-    curr->next = tn;
-    curr = tn;
-    /* Handle strings. If the token starts with ", scan until closing " */
-    if (curr->token[0] == '\"') {
-      char *s = strtok(NULL, "\"");
-      if (s) {
-        size_t sz = strlen(curr->token) + strlen(s) + 2; /* +2 for \" and \0 */
-        curr->token = realloc(curr->token, sz);
-        assert(curr->token);
-        strcat(curr->token, s);
-        strcat(curr->token, "\""); /* restore the closing " */
-      }
+  memset(&chunk, 0, sizeof(chunk));
+  chunk.src = &file->src;
+  chunk.end = file->src.size;
+  parse_chunk(&chunk, &file->arena);
+  if (chunk.error) {
+    fprintf(stderr, "Parser error, unrecognized symbol: %s\n", chunk.error);
+    arena_free(&file->arena);
+    source_close(&file->src);
+    free(file->path);
+    free(file);
+    return NULL;
+  }
+
+  file->head = chunk.head;
+  file->label = chunk.label;
+  file->next = include_cache;
+  include_cache = file;
+  return file;
+}
+
+/**
+ * Hands the lines of the file included by the .include line @line of the
+ * source @includer to @callback in order, as copies that are only valid
+ * until the callback returns. Includes in that file are replayed in turn.
+ *
+ * @label is the label waiting for a line, it goes to the first line that has
+ * none of its own, and a label left at the end of the file is put there.
+ *
+ * Returns 0 on success, -1 on an error, or the value that stopped the
+ * callback.
+ */
+static int replay_include(const struct line *line, const char *includer,
+    int depth, uint32_t *label, line_callback callback, void *ctx)
+{
+  struct include_file *file;
+  struct line *curr, copy;
+  char *path;
+  int rv = 0;
+
+  if (line->num_tokens < 2) {
+    fprintf(stderr, "Parser error, .include without a file name\n");
+    return -1;
+  }
+  if (depth >= MAX_INCLUDE_DEPTH) {
+    fprintf(stderr, "Parser error, .include nested too deeply: %s\n",
+        line_token(line, 1));
+    return -1;
+  }
+  if (line->label) *label = line->label;
+
+  path = include_path(line, includer);
+  file = include_lookup(path);
+  free(path);
+  if (!file) return -1;
+
+  for (curr = file->head; curr != NULL && rv == 0; curr = curr->next) {
+    if (curr->type == INCLUDE) {
+      rv = replay_include(curr, file->path, depth + 1, label, callback, ctx);
+      continue;
     }
+    copy = *curr;
+    copy.next = NULL;
+    if (!copy.label) copy.label = *label;
+    *label = SYM_NONE;
+    rv = callback(&copy, ctx);
   }
 
-  free(linebuf);
-  return next;
+  if (rv == 0 && file->label) *label = file->label;
+  return rv;
+}
+
+/* Line callback that appends a copy of the line to a struct line_list */
+static int append_line(struct line *line, void *ctx)
+{
+  struct line_list *list = ctx;
+  struct line *copy = arena_malloc(list->arena, sizeof(struct line));
+
+  *copy = *line;
+  if (list->tail) {
+    list->tail->next = copy;
+  } else {
+    list->head = copy;
+  }
+  list->tail = copy;
+  return 0;
+}
+
+/**
+ * Replaces the .include lines in the list *@head of lines of @src with
+ * copies of the lines of the files they include, allocated from @arena.
+ *
+ * Returns 0 on success, -1 if an include failed.
+ */
+static int expand_includes(struct line **head, struct source *src,
+    struct arena *arena)
+{
+  struct line_list list = {arena, NULL, NULL};
+  struct line *curr, *next;
+  uint32_t label = SYM_NONE;
+
+  for (curr = *head; curr != NULL; curr = next) {
+    next = curr->next;
+    if (curr->type == INCLUDE) {
+      if (replay_include(curr, src->path, 0, &label, append_line, &list) != 0)
+        return -1;
+      continue;
+    }
+
+    /* Lines of the source itself are linked in as they are */
+    if (!curr->label) curr->label = label;
+    label = SYM_NONE;
+    curr->next = NULL;
+    if (list.tail) {
+      list.tail->next = curr;
+    } else {
+      list.head = curr;
+    }
+    list.tail = curr;
+  }
+
+  *head = list.head;
+  return 0;
 }
 
 /* Public Interface */
 
-struct line* get_lines(char *infile)
+int parse_source(struct source *src, line_callback callback, void *ctx)
 {
-  struct line* head, *curr;
-  FILE *in = fopen(infile, "r");
+  struct parse_chunk chunk;
+  struct token_buffer tokens;
+  struct lexer lex;
+  struct arena scratch;
+  struct line *next;
+  size_t released = 0, consumed;
+  long page = sysconf(_SC_PAGESIZE);
+  int rv = 0;
 
 #ifdef DEBUG
-  assert(in);
+  assert(src->buf);
 #endif
 
-  if (!in) return NULL;
+  memset(&chunk, 0, sizeof(chunk));
+  memset(&tokens, 0, sizeof(tokens));
+  chunk.src = src;
+  chunk.copy = 1;
+  chunk.tokens = &tokens;
+  arena_init(&scratch);
+
+  /* A streamed source is parsed one window at a time */
+  for (;;) {
+    /* Only complete lines, unless the stream has ended */
+    chunk.end = src->fd >= 0 ? complete_lines(src->buf, src->size) : src->size;
+
+    lexer_init_range(&lex, src, 0, chunk.end);
+    while ((next = get_next_line(&lex, src->buf, &chunk, &scratch)) != NULL) {
+      if (next->type == INCLUDE) {
+        rv = replay_include(next, src->path, 0, &chunk.label, callback, ctx);
+      } else {
+        rv = callback(next, ctx);
+      }
+      if (rv != 0) break;
 
-  head = get_next_line(in);
-  if (!head) return NULL;
+      /* Nothing refers to the line any more */
+      arena_reset(&scratch);
 
-  curr = head;
-  do {
-    curr->next = get_next_line(in);
-    curr = curr->next;
-  } while (curr != NULL);
+      /* Hand back the pages of the source that have been consumed */
+      consumed = lex.toks[0].offset & ~(size_t)(page - 1);
+      if (src->mapped && consumed - released >= RELEASE_BYTES) {
+        madvise(src->buf + released, consumed - released, MADV_DONTNEED);
+        released = consumed;
+      }
+    }
+    lexer_free(&lex);
+
+    if (rv != 0 || chunk.error || src->fd < 0) break;
+    if (source_fill(src, chunk.end) < 0) {
+      fprintf(stderr, "Parser error, could not read the source\n");
+      rv = -1;
+      break;
+    }
+  }
+  /* The symbol is in the scratch arena */
+  if (chunk.error) {
+    fprintf(stderr, "Parser error, unrecognized symbol: %s\n", chunk.error);
+    rv = -1;
+  }
+  arena_free(&scratch);
+  free(tokens.text);
+  free(tokens.offset);
+  free(tokens.length);
+  return rv;
+}
+
+struct line* get_lines(struct source *src, struct arena *arena)
+{
+  struct parse_chunk chunk;
+  struct line *head;
+
+#ifdef DEBUG
+  assert(src->buf);
+#endif
+
+  if (source_read_all(src) != 0) {
+    fprintf(stderr, "Parser error, could not read the source\n");
+    return NULL;
+  }
+
+  memset(&chunk, 0, sizeof(chunk));
+  chunk.src = src;
+  chunk.end = src->size;
+  parse_chunk(&chunk, arena);
+
+  head = stitch_chunks(&chunk, 1);
+  if (head && chunk.includes && expand_includes(&head, src, arena) != 0)
+    return NULL;
+  return head;
+}
+
+struct line* get_lines_parallel(struct source *src, struct arena *arena,
+    struct pool *pool)
+{
+  struct parse_chunk *chunks;
+  struct line *head;
+  size_t n, i, begin, end, includes = 0;
+  const char *nl;
+
+#ifdef DEBUG
+  assert(src->buf);
+#endif
+
+  /* Chunks are cut from the whole source */
+  if (source_read_all(src) != 0) {
+    fprintf(stderr, "Parser error, could not read the source\n");
+    return NULL;
+  }
+
+  /* A few chunks per thread so an uneven chunk does not hold up the rest */
+  n = (size_t)pool_size(pool) * 4;
+  if (src->size / n < MIN_CHUNK_BYTES) n = src->size / MIN_CHUNK_BYTES;
+  if (n <= 1) return get_lines(src, arena);
+
+  chunks = calloc(n, sizeof(struct parse_chunk));
+  assert(chunks);
+
+  /* Cut just after a newline so that no line is split between chunks */
+  begin = 0;
+  for (i = 0; i < n; i++) {
+    end = (i == n - 1) ? src->size : src->size / n * (i + 1);
+    if (end < begin) end = begin;
+    if (end < src->size) {
+      nl = memchr(src->buf + end, '\n', src->size - end);
+      end = nl ? (size_t)(nl - src->buf) + 1 : src->size;
+    }
+    chunks[i].src = src;
+    chunks[i].begin = begin;
+    chunks[i].end = end;
+    arena_init(&chunks[i].arena);
+    begin = end;
+  }
+
+  pool_run(pool, n, parse_chunk_task, chunks);
 
-  fclose(in);
+  head = stitch_chunks(chunks, n);
+  for (i = 0; i < n; i++) {
+    includes += chunks[i].includes;
+    arena_merge(arena, &chunks[i].arena);
+  }
+  free(chunks);
+
+  if (head && includes && expand_includes(&head, src, arena) != 0)
+    return NULL;
   return head;
 }
 
+void include_cache_free(void)
+{
+  struct include_file *file;
+
+  while (include_cache != NULL) {
+    file = include_cache;
+    include_cache = file->next;
+    arena_free(&file->arena);
+    source_close(&file->src);
+    free(file->path);
+    free(file);
+  }
+}
+
 void print_lines(struct line* curr)
 {
-  struct token_node* tok = NULL;
+  uint32_t t;
 
   while (curr != NULL) {
 
@@ -256,26 +914,14 @@ void print_lines(struct line* curr)
 #endif
 
     if (curr->label) {
-      printf("%s\t", curr->label);
+      printf("%s:\t", symtab_name(curr->label));
     }
 
-    for (tok = curr->token_listhead; tok != NULL; tok = tok->next) {
-      printf("%s\t", tok->token);
+    for (t = 0; t < curr->num_tokens; t++) {
+      printf("%s\t", line_token(curr, t));
     }
     printf("\n");
     curr = curr->next;
   }//while
 
 }//print_line
-
-void free_lines(struct line* lines_head)
-{
-  struct line *curr = lines_head, *next;
-
-  while (curr != NULL) {
-    next = curr->next;
-    free_token_list(curr->token_listhead);
-    free(curr);
-    curr = next;
-  }
-}
@@ -30,46 +30,150 @@
 
 #include <stdint.h>
 
+#include "arena.h"
+#include "lexer.h"
+#include "pool.h"
+#include "symtab.h"
+
 //Linetype in RISC-V
+//Instructions follow the directives, in the order of instructions[] in
+//parser.c, so the linetype of an instruction line is its mnemonic ID.
 typedef enum {
   ALIGN = 0,
   ASCIIZ = 1,
   DATA = 2,
-  SPACE = 3,
-  TEXT = 4,
-  WORD = 5,
+  INCLUDE = 3,
+  SPACE = 4,
+  TEXT = 5,
+  WORD = 6,
   INST,
+  INST_ADD = INST,
+  INST_ADDI,
+  INST_AND,
+  INST_ANDI,
+  INST_AUIPC,
+  INST_BEQ,
+  INST_BNE,
+  INST_JAL,
+  INST_JALR,
+  INST_LUI,
+  INST_LW,
+  INST_OR,
+  INST_ORI,
+  INST_SLT,
+  INST_SLTI,
+  INST_SLL,
+  INST_SLLI,
+  INST_SRA,
+  INST_SRAI,
+  INST_SRL,
+  INST_SRLI,
+  INST_SUB,
+  INST_SW,
+  INST_XOR,
+  INST_XORI,
+  /* Psuedoinstructions */
+  INST_PSUEDO,
+  INST_J = INST_PSUEDO,
+  INST_LA,
+  INST_LI,
+  INST_MV,
+  INST_NEG,
+  INST_NOP,
+  INST_NOT,
+  INST_RET,
+  NUM_LINETYPES
 } linetype;
 
-struct token_node {
-  char *token;
-  struct token_node *next;
+/*
+ * Tokens of a run of lines as parallel arrays, so that the tokens of a line
+ * are a range of indexes rather than a list to walk.
+ */
+struct token_buffer {
+  char *text;         /* Token i is the NUL-terminated string text + offset[i] */
+  uint32_t *offset;
+  uint32_t *length;   /* Bytes in token i, not counting the NUL */
+  size_t count;
+  size_t cap;
 };
 
 struct line {
-  linetype type;  /* What kind of line this is */
-  char *label;    /* Assembler label, if any */
-  struct token_node* token_listhead;  /* Tokenized line */
+  linetype type;    /* What kind of line this is */
+  uint32_t label;   /* Symbol defined by a label on the line, or SYM_NONE */
+  uint32_t target;  /* Symbol a branch, jump or la refers to, or SYM_NONE */
+  const struct token_buffer *tokens;  /* Buffer holding the tokens */
+  uint32_t first_token;   /* Index of the directive or mnemonic in tokens */
+  uint32_t num_tokens;    /* Tokens on the line, not counting the label */
   struct line* next;
 };
 
 /**
- * Reads in all lines from the file named @infile.
+ * Returns token @i of @line, token 0 being the directive or mnemonic.
+ */
+static inline char* line_token(const struct line *line, size_t i)
+{
+  const struct token_buffer *tb = line->tokens;
+  return tb->text + tb->offset[line->first_token + i];
+}
+
+/**
+ * Returns the length of token @i of @line.
+ */
+static inline uint32_t line_token_length(const struct line *line, size_t i)
+{
+  return line->tokens->length[line->first_token + i];
+}
+
+/**
+ * Called with every line of a source in order by parse_source(). The line
+ * and its tokens are only valid until the callback returns.
+ *
+ * Returns 0 to keep parsing, anything else stops the parse.
+ */
+typedef int (*line_callback)(struct line *line, void *ctx);
+
+/**
+ * Streams the lines of @src to @callback as they are parsed. Only the line
+ * being handed over is held in memory, the token strings are copied out so
+ * the source is never written to, and consumed parts of a mapped source are
+ * given back to the operating system as parsing goes. A streamed source is
+ * read a window at a time, so pipes are parsed as the data arrives.
+ *
+ * Returns 0 on success, -1 on a parse error, or the value that stopped the
+ * callback.
+ */
+int parse_source(struct source *src, line_callback callback, void *ctx);
+
+/**
+ * Reads in all lines from the source @src, which must stay open for as long
+ * as the lines are in use: token strings point into its buffer. A streamed
+ * source is read to the end first.
  *
- * Returns an array of allocated and populated struct line objects.
+ * Returns a list of populated struct line objects allocated from @arena,
+ * they are released when the arena is reset or freed.
  *
  * Returns NULL if an error occurred.
  */
-struct line* get_lines(char *infile);
+struct line* get_lines(struct source *src, struct arena *arena);
 
 /**
- * Prints the lines to stdout, for debugging.
+ * Same as get_lines(), but splits @src at line boundaries into chunks that
+ * are tokenized and classified on the threads of @pool. The lines are
+ * stitched back together in source order, so the result is identical to
+ * that of get_lines().
  */
-void print_lines(struct line* lines_head);
+struct line* get_lines_parallel(struct source *src, struct arena *arena,
+    struct pool *pool);
+
+/**
+ * Releases the files cached for .include directives. Lines handed out by
+ * get_lines() may point into them, so call it once those are done with.
+ */
+void include_cache_free(void);
 
 /**
- * Frees all the memory allocated by the list of lines starting at head.
+ * Prints the lines to stdout, for debugging.
  */
-void free_lines(struct line* lines_head);
+void print_lines(struct line* lines_head);
 
 #endif /* PARSER_H_ */
@@ -0,0 +1,116 @@
+/*
+ * Worker thread pool for CS4200 at UCCS, Fall 2021
+ *
+ *  PURPOSE: Run independent pieces of parsing and assembly concurrently.
+ */
+
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <assert.h>
+
+struct pool {
+  pthread_t *threads;
+  int num_threads;            // including the caller of pool_run()
+
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+
+  // the batch being run, guarded by lock
+  pool_task_fn fn;
+  void *ctx;
+  size_t next_task;
+  size_t num_tasks;
+  size_t unfinished;
+  unsigned long generation;   // bumped for every batch
+  int shutdown;
+};
+
+// Claims and runs tasks of the current batch until there are none left.
+// Called with the lock held, returns with it held.
+static void _run_tasks(struct pool *pool){
+  while (pool->next_task < pool->num_tasks){
+    size_t task = pool->next_task++;
+    pthread_mutex_unlock(&pool->lock);
+    pool->fn(pool->ctx, task);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->unfinished == 0)
+      pthread_cond_broadcast(&pool->work_done);
+  }
+}
+
+static void *_worker(void *arg){
+  struct pool *pool = arg;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;){
+    while (!pool->shutdown && pool->generation == seen)
+      pthread_cond_wait(&pool->work_ready, &pool->lock);
+    if (pool->shutdown)
+      break;
+    seen = pool->generation;
+    _run_tasks(pool);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+struct pool *pool_create(int num_threads){
+  struct pool *pool = calloc(1, sizeof(struct pool));
+  assert(pool != NULL);
+
+  if (num_threads < 1)
+    num_threads = 1;
+  pool->num_threads = num_threads;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_ready, NULL);
+  pthread_cond_init(&pool->work_done, NULL);
+
+  pool->threads = calloc(num_threads, sizeof(pthread_t));
+  assert(pool->threads != NULL);
+  for (int i = 1; i < num_threads; i++){
+    int rv = pthread_create(&pool->threads[i], NULL, _worker, pool);
+    assert(rv == 0);
+  }
+  return pool;
+}
+
+int pool_size(struct pool *pool){
+  return pool->num_threads;
+}
+
+void pool_run(struct pool *pool, size_t num_tasks, pool_task_fn fn, void *ctx){
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->ctx = ctx;
+  pool->next_task = 0;
+  pool->num_tasks = num_tasks;
+  pool->unfinished = num_tasks;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work_ready);
+
+  // the caller works too rather than sleeping
+  _run_tasks(pool);
+  while (pool->unfinished > 0)
+    pthread_cond_wait(&pool->work_done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(struct pool *pool){
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 1; i < pool->num_threads; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_cond_destroy(&pool->work_done);
+  pthread_cond_destroy(&pool->work_ready);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
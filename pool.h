@@ -0,0 +1,28 @@
+/*
+ * Worker thread pool for CS4200 at UCCS, Fall 2021
+ *
+ *  PURPOSE: Run independent pieces of parsing and assembly concurrently.
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+
+struct pool;
+
+// fn is called once for every task index in [0, num_tasks)
+typedef void (*pool_task_fn)(void *ctx, size_t task);
+
+// Starts a pool with num_threads workers, the caller counts as one of them
+struct pool *pool_create(int num_threads);
+
+// Number of threads that run tasks, including the caller
+int pool_size(struct pool *pool);
+
+// Runs every task on the pool and returns once they have all finished
+void pool_run(struct pool *pool, size_t num_tasks, pool_task_fn fn, void *ctx);
+
+void pool_destroy(struct pool *pool);
+
+#endif /* POOL_H_ */
@@ -0,0 +1,293 @@
+/*
+ * RVC compression for CS4200 at UCCS, Fall 2021
+ *
+ *  PURPOSE: Give the 16-bit C extension form of an assembled RV32I
+             instruction, where its operands allow one, and back.
+ */
+
+#include "rvc.h"
+
+// Bits hi:lo of value, shifted down
+#define BITS(value, hi, lo) (((uint32_t)(value) >> (lo)) & ((1u << ((hi) - (lo) + 1)) - 1))
+
+// Opcodes of the base instructions that have a compressed form
+#define OP_LOAD   (0x03)
+#define OP_IMM    (0x13)
+#define OP_STORE  (0x23)
+#define OP_REG    (0x33)
+#define OP_LUI    (0x37)
+#define OP_BRANCH (0x63)
+#define OP_JALR   (0x67)
+#define OP_JAL    (0x6F)
+
+#define REG_ZERO (0)
+#define REG_RA (1)
+#define REG_SP (2)
+
+// The fields of an instruction, immediates sign extended
+struct sFields {
+  uint32_t opcode, rd, funct3, rs1, rs2, funct7;
+  int32_t imm_i, imm_s, imm_b, imm_j;
+  uint32_t imm_u;
+};
+
+static struct sFields _fields(uint32_t instr){
+  struct sFields f;
+
+  f.opcode = BITS(instr, 6, 0);
+  f.rd = BITS(instr, 11, 7);
+  f.funct3 = BITS(instr, 14, 12);
+  f.rs1 = BITS(instr, 19, 15);
+  f.rs2 = BITS(instr, 24, 20);
+  f.funct7 = BITS(instr, 31, 25);
+  f.imm_i = (int32_t)instr >> 20;
+  // gathered at the top, then shifted down to sign extend
+  f.imm_s = (int32_t)(BITS(instr, 31, 25) << 25 | BITS(instr, 11, 7) << 20) >> 20;
+  f.imm_b = (int32_t)(BITS(instr, 31, 31) << 31 | BITS(instr, 7, 7) << 30 |
+    BITS(instr, 30, 25) << 24 | BITS(instr, 11, 8) << 20) >> 19;
+  f.imm_j = (int32_t)(BITS(instr, 31, 31) << 31 | BITS(instr, 19, 12) << 23 |
+    BITS(instr, 20, 20) << 22 | BITS(instr, 30, 21) << 12) >> 11;
+  f.imm_u = BITS(instr, 31, 12);
+  return f;
+}
+
+// x8-x15 are the registers the 3-bit fields reach
+static int _is_creg(uint32_t reg){
+  return reg >= 8 && reg <= 15;
+}
+
+static int _fits(int32_t value, int bits){
+  return value >= -(1 << (bits - 1)) && value < (1 << (bits - 1));
+}
+
+/*------------ Formats -------------*/
+// CI: funct3 | imm[5] | rd | imm[4:0] | op
+static uint16_t _ci(uint32_t funct3, int32_t imm, uint32_t rd, uint32_t op){
+  return (uint16_t)(funct3 << 13 | BITS(imm, 5, 5) << 12 | rd << 7 |
+    BITS(imm, 4, 0) << 2 | op);
+}
+
+// CR: funct4 | rd/rs1 | rs2 | op
+static uint16_t _cr(uint32_t funct4, uint32_t rd, uint32_t rs2, uint32_t op){
+  return (uint16_t)(funct4 << 12 | rd << 7 | rs2 << 2 | op);
+}
+
+// CB for shifts and andi: funct3 | imm[5] | funct2 | rd' | imm[4:0] | 01
+static uint16_t _cb_alu(uint32_t funct2, int32_t imm, uint32_t rd){
+  return (uint16_t)(0x4 << 13 | BITS(imm, 5, 5) << 12 | funct2 << 10 |
+    (rd - 8) << 7 | BITS(imm, 4, 0) << 2 | 0x1);
+}
+
+// CA: 100011 | rd' | funct2 | rs2' | 01
+static uint16_t _ca(uint32_t funct2, uint32_t rd, uint32_t rs2){
+  return (uint16_t)(0x23 << 10 | (rd - 8) << 7 | funct2 << 5 | (rs2 - 8) << 2 | 0x1);
+}
+
+// CL and CS word access: funct3 | uimm[5:3] | rs1' | uimm[2|6] | rd'/rs2' | 00
+static uint16_t _cl(uint32_t funct3, int32_t imm, uint32_t rs1, uint32_t reg){
+  return (uint16_t)(funct3 << 13 | BITS(imm, 5, 3) << 10 | (rs1 - 8) << 7 |
+    BITS(imm, 2, 2) << 6 | BITS(imm, 6, 6) << 5 | (reg - 8) << 2);
+}
+
+// CJ: funct3 | imm[11|4|9:8|10|6|7|3:1|5] | 01
+static uint16_t _cj(uint32_t funct3, int32_t imm){
+  return (uint16_t)(funct3 << 13 | BITS(imm, 11, 11) << 12 | BITS(imm, 4, 4) << 11 |
+    BITS(imm, 9, 8) << 9 | BITS(imm, 10, 10) << 8 | BITS(imm, 6, 6) << 7 |
+    BITS(imm, 7, 7) << 6 | BITS(imm, 3, 1) << 3 | BITS(imm, 5, 5) << 2 | 0x1);
+}
+
+// CB branch: funct3 | imm[8|4:3] | rs1' | imm[7:6|2:1|5] | 01
+static uint16_t _cb_branch(uint32_t funct3, int32_t imm, uint32_t rs1){
+  return (uint16_t)(funct3 << 13 | BITS(imm, 8, 8) << 12 | BITS(imm, 4, 3) << 10 |
+    (rs1 - 8) << 7 | BITS(imm, 7, 6) << 5 | BITS(imm, 2, 1) << 3 |
+    BITS(imm, 5, 5) << 2 | 0x1);
+}
+
+
+/*------------ Compression -------------*/
+static uint16_t _compress_imm(const struct sFields *f){
+  int32_t imm = f->imm_i;
+
+  switch (f->funct3){
+    // addi, and the nop, mv, li and stack forms it covers
+    case 0x0:
+      if (f->rd == REG_ZERO)
+        return (f->rs1 == REG_ZERO && imm == 0) ? 0x0001 : 0;   // c.nop
+      if (imm == 0 && f->rs1 != REG_ZERO)
+        return _cr(0x8, f->rd, f->rs1, 0x2);                      // c.mv
+      if (f->rs1 == REG_ZERO && _fits(imm, 6))
+        return _ci(0x2, imm, f->rd, 0x1);                         // c.li
+      if (f->rd == f->rs1 && imm != 0 && _fits(imm, 6))
+        return _ci(0x0, imm, f->rd, 0x1);                         // c.addi
+      if (f->rd == REG_SP && f->rs1 == REG_SP && imm != 0 && imm % 16 == 0 &&
+          _fits(imm, 10))                                         // c.addi16sp
+        return (uint16_t)(0x3 << 13 | BITS(imm, 9, 9) << 12 | REG_SP << 7 |
+          BITS(imm, 4, 4) << 6 | BITS(imm, 6, 6) << 5 | BITS(imm, 8, 7) << 3 |
+          BITS(imm, 5, 5) << 2 | 0x1);
+      if (_is_creg(f->rd) && f->rs1 == REG_SP && imm > 0 && imm % 4 == 0 &&
+          imm < 1024)                                             // c.addi4spn
+        return (uint16_t)(BITS(imm, 5, 4) << 11 | BITS(imm, 9, 6) << 7 |
+          BITS(imm, 2, 2) << 6 | BITS(imm, 3, 3) << 5 | (f->rd - 8) << 2);
+      return 0;
+
+    // andi
+    case 0x7:
+      if (_is_creg(f->rd) && f->rd == f->rs1 && _fits(imm, 6))
+        return _cb_alu(0x2, imm, f->rd);
+      return 0;
+
+    // slli
+    case 0x1:
+      if (f->rd != REG_ZERO && f->rd == f->rs1 && f->rs2 != 0)
+        return _ci(0x0, (int32_t)f->rs2, f->rd, 0x2);
+      return 0;
+
+    // srli and srai
+    case 0x5:
+      if (_is_creg(f->rd) && f->rd == f->rs1 && f->rs2 != 0)
+        return _cb_alu(f->funct7 ? 0x1 : 0x0, (int32_t)f->rs2, f->rd);
+      return 0;
+  }
+  return 0;
+}
+
+static uint16_t _compress_reg(const struct sFields *f){
+  // the other source, when one of them is rd
+  uint32_t other = f->rd == f->rs1 ? f->rs2 : f->rs1;
+
+  if (f->funct7 == 0x20 && f->funct3 == 0x0){
+    // sub
+    if (_is_creg(f->rd) && f->rd == f->rs1 && _is_creg(f->rs2))
+      return _ca(0x0, f->rd, f->rs2);
+    return 0;
+  }
+  if (f->funct7 != 0)
+    return 0;
+
+  switch (f->funct3){
+    // add
+    case 0x0:
+      if (f->rd == REG_ZERO)
+        return 0;
+      if (f->rs1 == REG_ZERO && f->rs2 != REG_ZERO)
+        return _cr(0x8, f->rd, f->rs2, 0x2);                      // c.mv
+      if (f->rs2 == REG_ZERO && f->rs1 != REG_ZERO)
+        return _cr(0x8, f->rd, f->rs1, 0x2);
+      if ((f->rd == f->rs1 || f->rd == f->rs2) && other != REG_ZERO)
+        return _cr(0x9, f->rd, other, 0x2);                       // c.add
+      return 0;
+
+    // xor, or and and
+    case 0x4:
+    case 0x6:
+    case 0x7:
+      if (_is_creg(f->rd) && (f->rd == f->rs1 || f->rd == f->rs2) && _is_creg(other))
+        return _ca(f->funct3 == 0x4 ? 0x1 : f->funct3 == 0x6 ? 0x2 : 0x3, f->rd, other);
+      return 0;
+  }
+  return 0;
+}
+
+uint16_t rvc_compress(uint32_t instr){
+  struct sFields f = _fields(instr);
+
+  switch (f.opcode){
+    case OP_IMM:
+      return _compress_imm(&f);
+
+    case OP_REG:
+      return _compress_reg(&f);
+
+    // lw
+    case OP_LOAD:
+      if (f.funct3 != 0x2 || f.imm_i < 0 || f.imm_i % 4 != 0)
+        return 0;
+      if (f.rs1 == REG_SP && f.rd != REG_ZERO && f.imm_i < 256)  // c.lwsp
+        return (uint16_t)(0x2 << 13 | BITS(f.imm_i, 5, 5) << 12 | f.rd << 7 |
+          BITS(f.imm_i, 4, 2) << 4 | BITS(f.imm_i, 7, 6) << 2 | 0x2);
+      if (_is_creg(f.rs1) && _is_creg(f.rd) && f.imm_i < 128)
+        return _cl(0x2, f.imm_i, f.rs1, f.rd);                    // c.lw
+      return 0;
+
+    // sw
+    case OP_STORE:
+      if (f.funct3 != 0x2 || f.imm_s < 0 || f.imm_s % 4 != 0)
+        return 0;
+      if (f.rs1 == REG_SP && f.imm_s < 256)                       // c.swsp
+        return (uint16_t)(0x6 << 13 | BITS(f.imm_s, 5, 2) << 9 |
+          BITS(f.imm_s, 7, 6) << 7 | f.rs2 << 2 | 0x2);
+      if (_is_creg(f.rs1) && _is_creg(f.rs2) && f.imm_s < 128)
+        return _cl(0x6, f.imm_s, f.rs1, f.rs2);                   // c.sw
+      return 0;
+
+    // the upper 20 bits must be a 6-bit signed value other than 0
+    case OP_LUI:{
+      int32_t imm = (int32_t)(f.imm_u << 12) >> 12;
+      if (f.rd != REG_ZERO && f.rd != REG_SP && imm != 0 && _fits(imm, 6))
+        return _ci(0x3, imm, f.rd, 0x1);
+      return 0;
+    }
+
+    // beq and bne against x0
+    case OP_BRANCH:
+      if (f.funct3 <= 0x1 && f.rs2 == REG_ZERO && _is_creg(f.rs1) && _fits(f.imm_b, 9))
+        return _cb_branch(f.funct3 == 0x0 ? 0x6 : 0x7, f.imm_b, f.rs1);
+      return 0;
+
+    // jal with x0 or ra
+    case OP_JAL:
+      if (f.rd == REG_ZERO && _fits(f.imm_j, 12))
+        return _cj(0x5, f.imm_j);                                 // c.j
+      if (f.rd == REG_RA && _fits(f.imm_j, 12))
+        return _cj(0x1, f.imm_j);                                 // c.jal
+      return 0;
+
+    // jalr with no offset, to x0 or ra
+    case OP_JALR:
+      if (f.imm_i != 0 || f.rs1 == REG_ZERO)
+        return 0;
+      if (f.rd == REG_ZERO)
+        return _cr(0x8, f.rs1, 0, 0x2);                           // c.jr
+      if (f.rd == REG_RA)
+        return _cr(0x9, f.rs1, 0, 0x2);                           // c.jalr
+      return 0;
+  }
+  return 0;
+}
+
+
+/*------------ Expansion -------------*/
+uint32_t rvc_expand(uint16_t halfword){
+  uint32_t funct3 = BITS(halfword, 15, 13);
+  uint32_t imm, rd, rs1;
+
+  if (BITS(halfword, 1, 0) != 0x1)
+    return 0;
+
+  switch (funct3){
+    // c.jal and c.j, imm[11|4|9:8|10|6|7|3:1|5] back to jal
+    case 0x1:
+    case 0x5:
+      imm = BITS(halfword, 12, 12) << 11 | BITS(halfword, 8, 8) << 10 |
+        BITS(halfword, 10, 9) << 8 | BITS(halfword, 6, 6) << 7 |
+        BITS(halfword, 7, 7) << 6 | BITS(halfword, 2, 2) << 5 |
+        BITS(halfword, 11, 11) << 4 | BITS(halfword, 5, 3) << 1;
+      imm = (uint32_t)((int32_t)(imm << 20) >> 20);
+      rd = funct3 == 0x1 ? REG_RA : REG_ZERO;
+      return BITS(imm, 20, 20) << 31 | BITS(imm, 10, 1) << 21 |
+        BITS(imm, 11, 11) << 20 | BITS(imm, 19, 12) << 12 | rd << 7 | OP_JAL;
+
+    // c.beqz and c.bnez, imm[8|4:3] and imm[7:6|2:1|5] back to beq and bne
+    case 0x6:
+    case 0x7:
+      imm = BITS(halfword, 12, 12) << 8 | BITS(halfword, 6, 5) << 6 |
+        BITS(halfword, 2, 2) << 5 | BITS(halfword, 11, 10) << 3 |
+        BITS(halfword, 4, 3) << 1;
+      imm = (uint32_t)((int32_t)(imm << 23) >> 23);
+      rs1 = BITS(halfword, 9, 7) + 8;
+      return BITS(imm, 12, 12) << 31 | BITS(imm, 10, 5) << 25 | REG_ZERO << 20 |
+        rs1 << 15 | (funct3 - 0x6) << 12 | BITS(imm, 4, 1) << 8 |
+        BITS(imm, 11, 11) << 7 | OP_BRANCH;
+  }
+  return 0;
+}
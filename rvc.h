@@ -0,0 +1,24 @@
+/*
+ * RVC compression for CS4200 at UCCS, Fall 2021
+ *
+ *  PURPOSE: Give the 16-bit C extension form of an assembled RV32I
+             instruction, where its operands allow one, and back.
+ */
+
+#ifndef RVC_H_
+#define RVC_H_
+
+#include <stdint.h>
+
+// A 32-bit instruction has the low two bits set, a compressed one does not
+#define RVC_IS_COMPRESSED(halfword) (((halfword) & 0x3) != 0x3)
+
+// Returns the compressed form of instr, or 0 if there is none. Branches and
+// jumps must have their offset bound already.
+uint16_t rvc_compress(uint32_t instr);
+
+// Returns the 32-bit form of a compressed jump or branch (c.j, c.jal,
+// c.beqz, c.bnez) with its offset, or 0 for any other instruction
+uint32_t rvc_expand(uint16_t halfword);
+
+#endif /* RVC_H_ */
@@ -0,0 +1,175 @@
+/*
+ * Symbol interner for CS4200 at UCCS, Fall 2021
+ *
+ *  PURPOSE: Give every distinct label name one 32-bit ID, so that labels are
+             carried and compared as integers after parsing.
+ */
+
+#include "symtab.h"
+
+#include "arena.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define SYMTAB_MIN_SLOTS (64)
+
+// Names are spread over shards by hash, each with a lock, slots and names
+// of its own, so threads interning different names rarely wait on each
+// other. IDs stay dense across all shards.
+#define SYMTAB_SHARD_BITS (6)
+#define SYMTAB_SHARDS (1 << SYMTAB_SHARD_BITS)
+
+// Symbols are kept in pages that never move, so a name is read without a
+// lock while other threads add symbols
+#define SYMTAB_PAGE_BITS (12)
+#define SYMTAB_PAGE (1 << SYMTAB_PAGE_BITS)
+#define SYMTAB_MAX_PAGES (1 << 16)
+
+struct sSymbol {
+  const char *name;   // copy owned by the names arena of its shard
+  uint32_t len;
+  uint32_t hash;
+};
+
+struct sShard {
+  pthread_mutex_t lock;
+  struct arena names;
+  uint32_t *slots;    // open addressing table of IDs, 0 is empty
+  uint32_t num_slots;
+  uint32_t num_used;
+};
+
+// One interner for the whole process
+static struct sShard shards[SYMTAB_SHARDS];
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sSymbol *pages[SYMTAB_MAX_PAGES];   // by ID, entry 0 is SYM_NONE
+static uint32_t num_symbols = 1;
+
+// The mutexes have no static initializer as an array
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void _init_shards(void){
+  for (int i = 0; i < SYMTAB_SHARDS; i++)
+    pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+// FNV-1a, labels are short so anything fancier would not pay off
+static uint32_t _hash(const char *name, size_t len){
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++){
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static struct sSymbol *_symbol(uint32_t id){
+  struct sSymbol *page = __atomic_load_n(&pages[id >> SYMTAB_PAGE_BITS], __ATOMIC_ACQUIRE);
+  return &page[id & (SYMTAB_PAGE - 1)];
+}
+
+// Makes room for id, the first thread to reach a page allocates it
+static void _reserve(uint32_t id){
+  struct sSymbol **page = &pages[id >> SYMTAB_PAGE_BITS];
+
+  assert((id >> SYMTAB_PAGE_BITS) < SYMTAB_MAX_PAGES);
+  if (__atomic_load_n(page, __ATOMIC_ACQUIRE) != NULL)
+    return;
+  pthread_mutex_lock(&page_lock);
+  if (*page == NULL){
+    struct sSymbol *symbols = calloc(SYMTAB_PAGE, sizeof(struct sSymbol));
+    assert(symbols != NULL);
+    __atomic_store_n(page, symbols, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&page_lock);
+}
+
+// Doubles the slot table of shard and reinserts its symbols, keeping it
+// half empty
+static void _grow_slots(struct sShard *shard){
+  uint32_t new_slots = shard->num_slots ? shard->num_slots * 2 : SYMTAB_MIN_SLOTS;
+  uint32_t *table = calloc(new_slots, sizeof(uint32_t));
+  assert(table != NULL);
+
+  for (uint32_t j = 0; j < shard->num_slots; j++){
+    uint32_t id = shard->slots[j], i;
+    if (id == SYM_NONE)
+      continue;
+    i = _symbol(id)->hash & (new_slots - 1);
+    while (table[i] != SYM_NONE)
+      i = (i + 1) & (new_slots - 1);
+    table[i] = id;
+  }
+
+  free(shard->slots);
+  shard->slots = table;
+  shard->num_slots = new_slots;
+}
+
+uint32_t symtab_intern(const char *name, size_t len){
+  uint32_t hash = _hash(name, len);
+  struct sShard *shard = &shards[hash >> (32 - SYMTAB_SHARD_BITS)];
+  uint32_t i, id;
+
+  pthread_once(&once, _init_shards);
+  pthread_mutex_lock(&shard->lock);
+  if (shard->num_slots == 0)
+    _grow_slots(shard);
+
+  // Linear probing, stops at the symbol or the empty slot it belongs in
+  for (i = hash & (shard->num_slots - 1); (id = shard->slots[i]) != SYM_NONE;
+      i = (i + 1) & (shard->num_slots - 1)){
+    struct sSymbol *sym = _symbol(id);
+    if (sym->hash == hash && sym->len == len && memcmp(sym->name, name, len) == 0){
+      pthread_mutex_unlock(&shard->lock);
+      return id;
+    }
+  }
+
+  // New symbol, its ID taken from all shards
+  char *copy = arena_malloc(&shard->names, len + 1);
+  memcpy(copy, name, len);
+  copy[len] = 0;
+
+  id = __atomic_fetch_add(&num_symbols, 1, __ATOMIC_RELAXED);
+  _reserve(id);
+  *_symbol(id) = (struct sSymbol){.name = copy, .len = (uint32_t)len, .hash = hash};
+  shard->slots[i] = id;
+  if (++shard->num_used * 2 > shard->num_slots)
+    _grow_slots(shard);
+
+  pthread_mutex_unlock(&shard->lock);
+  return id;
+}
+
+// Lock free, symtab_intern() writes the symbol before it returns its ID
+const char *symtab_name(uint32_t id){
+  if (id == SYM_NONE || id >= __atomic_load_n(&num_symbols, __ATOMIC_ACQUIRE))
+    return NULL;
+  return _symbol(id)->name;
+}
+
+uint32_t symtab_count(void){
+  return __atomic_load_n(&num_symbols, __ATOMIC_ACQUIRE);
+}
+
+// Not safe while any thread is interning
+void symtab_free(void){
+  pthread_once(&once, _init_shards);
+  for (int i = 0; i < SYMTAB_SHARDS; i++){
+    struct sShard *shard = &shards[i];
+    arena_free(&shard->names);
+    free(shard->slots);
+    shard->slots = NULL;
+    shard->num_slots = 0;
+    shard->num_used = 0;
+  }
+  for (uint32_t page = 0; page < SYMTAB_MAX_PAGES && pages[page] != NULL; page++){
+    free(pages[page]);
+    pages[page] = NULL;
+  }
+  num_symbols = 1;
+}
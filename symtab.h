@@ -0,0 +1,32 @@
+/*
+ * Symbol interner for CS4200 at UCCS, Fall 2021
+ *
+ *  PURPOSE: Give every distinct label name one 32-bit ID, so that labels are
+             carried and compared as integers after parsing.
+ */
+
+#ifndef SYMTAB_H_
+#define SYMTAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// No symbol, zeroed structures start out without one
+#define SYM_NONE (0)
+
+// Returns the ID of the len bytes at name, the same ID every time for the
+// same name. Safe to call from several threads at once.
+uint32_t symtab_intern(const char *name, size_t len);
+
+// Returns the NUL-terminated name of id, or NULL for SYM_NONE. Takes no
+// lock, any thread may look up an ID it was handed.
+const char *symtab_name(uint32_t id);
+
+// One more than the largest ID handed out so far
+uint32_t symtab_count(void);
+
+// Forgets every symbol, IDs handed out before are no longer valid. No
+// other thread may be using the table.
+void symtab_free(void);
+
+#endif /* SYMTAB_H_ */
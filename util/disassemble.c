@@ -28,12 +28,12 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
-#define DEBUG
+#include "../writer.h"
 
-#define DATA_BEGIN (0x10000000)
-#define TEXT_BEGIN (0x00400000)
+#define DEBUG
 
 
 /* Decode feature is not fully implemented */
@@ -132,50 +132,163 @@ char *decode(uint32_t word) {
 }
 
 
-static void read_and_print(char *infile, size_t data_words, size_t text_words)
+/* Names the 16-bit compressed instruction @half, as mas --rvc emits them */
+char *decode_compressed(uint16_t half) {
+  uint8_t funct3 = (half>>13)&0x7;
+  uint8_t rd = (half>>7)&0x1f, rs2 = (half>>2)&0x1f;
+
+  switch (half&0x3) {
+    case 0x0:
+      if (funct3 == 0x0 && half != 0) return "c.addi4spn";
+      if (funct3 == 0x2) return "c.lw";
+      if (funct3 == 0x6) return "c.sw";
+      break;
+
+    case 0x1:
+      switch (funct3) {
+        case 0x0:
+          return rd ? "c.addi" : "c.nop";
+        case 0x1:
+          return "c.jal";
+        case 0x2:
+          return "c.li";
+        case 0x3:
+          return rd == 2 ? "c.addi16sp" : "c.lui";
+        case 0x4: /* arithmetic on x8-x15 */
+          switch ((half>>10)&0x3) {
+            case 0x0:
+              return "c.srli";
+            case 0x1:
+              return "c.srai";
+            case 0x2:
+              return "c.andi";
+            case 0x3:
+              if (half&0x1000) break;
+              switch ((half>>5)&0x3) {
+                case 0x0:
+                  return "c.sub";
+                case 0x1:
+                  return "c.xor";
+                case 0x2:
+                  return "c.or";
+                case 0x3:
+                  return "c.and";
+              }
+          }
+          break;
+        case 0x5:
+          return "c.j";
+        case 0x6:
+          return "c.beqz";
+        case 0x7:
+          return "c.bnez";
+      }
+      break;
+
+    case 0x2:
+      switch (funct3) {
+        case 0x0:
+          return "c.slli";
+        case 0x2:
+          return "c.lwsp";
+        case 0x4:
+          if (!(half&0x1000)) return rs2 ? "c.mv" : "c.jr";
+          if (rd == 0 && rs2 == 0) return "c.ebreak";
+          return rs2 ? "c.add" : "c.jalr";
+        case 0x6:
+          return "c.swsp";
+      }
+      break;
+  }
+
+  return "IllegalInst";
+}
+
+
+/* The little-endian 32-bit word at @bytes */
+static uint32_t read_word(const uint8_t *bytes)
+{
+  return bytes[0] | (uint32_t)bytes[1]<<8 | (uint32_t)bytes[2]<<16 |
+    (uint32_t)bytes[3]<<24;
+}
+
+/* Reads @len bytes of a segment and its padding to a whole word */
+static uint8_t *read_segment(FILE *in, uint32_t len)
+{
+  size_t padded = (len + 3) & ~(size_t)3;
+  uint8_t *bytes = calloc(padded + 4, 1);
+  size_t count;
+
+  assert(bytes != NULL);
+  count = fread(bytes, 1, padded, in);
+  assert(count == padded);
+  return bytes;
+}
+
+static void read_and_print(char *infile)
 {
+  uint8_t header[20];
+  uint32_t data_base, data_len, text_base, text_len;
+  uint8_t *data, *text;
   size_t count;
   FILE *in;
-  uint32_t *data = malloc(sizeof(uint32_t)*data_words);
-  uint32_t *text = malloc(sizeof(uint32_t)*text_words);
-
-  assert(data != NULL);
-  assert(text != NULL);
 
 	in = fopen(infile, "r");
   assert(in);
 
-  count = fread(data, sizeof(uint32_t), data_words, in);
-  assert(count == data_words);
-  count = fread(text, sizeof(uint32_t), text_words, in);
-  assert(count == text_words);
+  /* see write_program() for the layout */
+  count = fread(header, 1, sizeof(header), in);
+  assert(count == sizeof(header));
+  assert(memcmp(header, PROGRAM_MAGIC, 4) == 0);
+  data_base = read_word(header + 4);
+  data_len = read_word(header + 8);
+  text_base = read_word(header + 12);
+  text_len = read_word(header + 16);
+
+  data = read_segment(in, data_len);
+  text = read_segment(in, text_len);
 
   printf("\n%s:\tfile format cs4200-riscv32\n\n", infile);
 
   printf(".data\n");
-  for (count = 0; count < data_words; count++) {
+  for (count = 0; count < data_len; count += 4) {
+    uint32_t word = read_word(data + count);
     printf("%.8X:\t%.2x %.2x %.2x %.2x\t%s\n",
-        (uint32_t)(DATA_BEGIN + count*4),
-        data[count] >> 24 & 0xff,
-        data[count] >> 16 & 0xff,
-        data[count] >> 8 & 0xff,
-        data[count] >> 0 & 0xff,
-        decode(data[count]));
+        (uint32_t)(data_base + count),
+        word >> 24 & 0xff,
+        word >> 16 & 0xff,
+        word >> 8 & 0xff,
+        word >> 0 & 0xff,
+        decode(word));
   }
   printf("\n");
 
+  /* an instruction is 2 bytes if its low two bits are not both set */
   printf(".text\n");
-  for (count = 0; count < text_words; count++) {
-    printf("%.8X:\t%.2x %.2x %.2x %.2x\t%s\n",
-        (uint32_t)(TEXT_BEGIN + count*4),
-        text[count] >> 24 & 0xff,
-        text[count] >> 16 & 0xff,
-        text[count] >> 8 & 0xff,
-        text[count] >> 0 & 0xff,
-        decode(text[count]));
+  for (count = 0; count < text_len; ) {
+    uint32_t word = read_word(text + count);
+    if ((word&0x3) != 0x3) {
+      printf("%.8X:\t%.2x %.2x      \t%s\n",
+          (uint32_t)(text_base + count),
+          word >> 8 & 0xff,
+          word >> 0 & 0xff,
+          decode_compressed((uint16_t)word));
+      count += 2;
+    } else {
+      printf("%.8X:\t%.2x %.2x %.2x %.2x\t%s\n",
+          (uint32_t)(text_base + count),
+          word >> 24 & 0xff,
+          word >> 16 & 0xff,
+          word >> 8 & 0xff,
+          word >> 0 & 0xff,
+          decode(word));
+      count += 4;
+    }
   }
   printf("\n");
 
+  free(data);
+  free(text);
   fclose(in);
 }
 
@@ -191,6 +304,6 @@ where:\n\
 int main( int argc, char *argv[] )
 {
 	if ( argc < 2 ) usage(argv[0]);
-  read_and_print(argv[1], 1024, 1024);
+  read_and_print(argv[1]);
 	return 0;
 }
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2021 Regents of University of Colorado
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../immediate.h"
+
+/* Operands the benchmark cycles through, all of which strtol reads too */
+static const char *sample[] = {
+  "0", "4", "-8", "12", "2047", "-2048", "31", "0x10", "0x7ff", "-0x800",
+  "0xFFFFF", "100000", "-1", "0x12345678", "255", "0755",
+};
+#define NUM_SAMPLES (sizeof(sample) / sizeof(sample[0]))
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parses @count operands with imm_parse, returns a checksum of the values. */
+static int64_t run_imm(size_t count, double *secs)
+{
+  const char *end;
+  int64_t value, sum = 0;
+  double start = now();
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    if (imm_parse(sample[i % NUM_SAMPLES], &end, &value) != 0) break;
+    sum += value;
+  }
+  *secs = now() - start;
+  return sum;
+}
+
+/* The same with strtol, as the assembler used to */
+static int64_t run_strtol(size_t count, double *secs)
+{
+  char *end;
+  int64_t sum = 0;
+  double start = now();
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    sum += strtol(sample[i % NUM_SAMPLES], &end, 0);
+  }
+  *secs = now() - start;
+  return sum;
+}
+
+void usage(char *name)
+{
+  printf("Usage: %s [operands]\n\
+where:\n\
+\t[operands] is the number of immediates to parse (default 10000000).\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t count = 10000000;
+  int64_t reference, sum;
+  double strtol_secs = 0, secs = 0;
+
+  if (argc > 2) usage(argv[0]);
+  if (argc == 2 && (count = strtoul(argv[1], NULL, 10)) == 0) usage(argv[0]);
+
+  reference = run_strtol(count, &strtol_secs);
+  sum = run_imm(count, &secs);
+
+  printf("%zu operands\n", count);
+  printf("%-10s %8.3f ms  %6.1f ns/op\n", "strtol", strtol_secs * 1e3,
+      strtol_secs / count * 1e9);
+  printf("%-10s %8.3f ms  %6.1f ns/op  %5.2fx  %s\n", "imm_parse", secs * 1e3,
+      secs / count * 1e9, strtol_secs / secs,
+      sum == reference ? "values match" : "VALUES DIFFER");
+  return sum == reference ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2021 Regents of University of Colorado
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "../lexer.h"
+
+/* Lines the synthetic source is built from when no file is given */
+static const char *sample[] = {
+  "_start:\tla t0, myvar\n",
+  "\tlw\tt1,    0(t0) # myvar[0]\n",
+  "lw      t2,\t4(t0)\t\t# myvar[1]\n",
+  "\tadd\tx2, t1, t2 \n",
+  "\n",
+  "# a comment on its own, with \"quotes\" and, commas\n",
+  "msg: .asciiz \"Hello, world! # not a comment\"\n",
+  "  srai t0,a0,31\n",
+  "\tbeq\tx2, t3, _start# \tbetter not be equal\n",
+  "myvar:   .word 5, -10, \t15\n",
+};
+
+static void synthesize(struct source *src, size_t lines)
+{
+  size_t n = sizeof(sample) / sizeof(sample[0]);
+  size_t i, len, cap = lines * 48, used = 0;
+
+  src->buf = malloc(cap + 1);
+  assert(src->buf);
+  for (i = 0; i < lines; i++) {
+    len = strlen(sample[i % n]);
+    if (used + len > cap) {
+      cap *= 2;
+      src->buf = realloc(src->buf, cap + 1);
+      assert(src->buf);
+    }
+    memcpy(src->buf + used, sample[i % n], len);
+    used += len;
+  }
+  src->buf[used] = 0;
+  src->size = used;
+  src->mapped = 0;
+  src->fd = -1;
+  src->path = NULL;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Lexes all of @src with @kernel, returns a checksum of the tokens. */
+static uint64_t run_once(struct source *src, enum lexer_kernel kernel, double *secs)
+{
+  struct lexer lex;
+  uint64_t sum = 0;
+  size_t i, n;
+  double start;
+
+  lexer_init(&lex, src);
+  if (lexer_select(&lex, kernel) != 0) {
+    lexer_free(&lex);
+    return 0;
+  }
+
+  start = now();
+  while ((n = lexer_next_line(&lex)) > 0) {
+    for (i = 0; i < n; i++) {
+      sum = sum * 31 + lex.toks[i].offset * 7 + lex.toks[i].length;
+    }
+    sum += n;
+  }
+  *secs = now() - start;
+
+  lexer_free(&lex);
+  return sum;
+}
+
+/* Best of a few runs, the machine is rarely quiet */
+#define RUNS (5)
+static uint64_t run(struct source *src, enum lexer_kernel kernel, double *secs)
+{
+  uint64_t sum = 0;
+  double t;
+  int i;
+
+  *secs = 1e9;
+  for (i = 0; i < RUNS; i++) {
+    sum = run_once(src, kernel, &t);
+    if (t < *secs) *secs = t;
+  }
+  return sum;
+}
+
+void usage(char *name)
+{
+  printf("Usage: %s [lines | input source]\n\
+where:\n\
+\t[lines] is the number of lines of synthetic source to lex (default 1000000).\n\
+\t[input source] is a file containing assembly source code.\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  static const char *names[] = { "auto", "scalar", "sse2", "avx2" };
+  struct source src;
+  uint64_t reference = 0, sum;
+  double secs, scalar_secs = 0;
+  int k;
+
+  if (argc > 2) usage(argv[0]);
+
+  if (argc == 2 && source_open(&src, argv[1]) == 0 &&
+      source_read_all(&src) == 0) {
+    printf("%s: %zu bytes\n", argv[1], src.size);
+  } else {
+    size_t lines = argc == 2 ? strtoul(argv[1], NULL, 10) : 1000000;
+    if (lines == 0) usage(argv[0]);
+    synthesize(&src, lines);
+    printf("synthetic: %zu lines, %zu bytes\n", lines, src.size);
+  }
+
+  /* Fault the source in so no kernel pays for it */
+  run_once(&src, LEXER_SCALAR, &secs);
+
+  for (k = LEXER_SCALAR; k <= LEXER_AVX2; k++) {
+    sum = run(&src, (enum lexer_kernel)k, &secs);
+    if (sum == 0) {
+      printf("%-8s unsupported on this CPU\n", names[k]);
+      continue;
+    }
+    if (k == LEXER_SCALAR) {
+      reference = sum;
+      scalar_secs = secs;
+    }
+    printf("%-8s %8.3f ms  %7.1f MB/s  %5.2fx  %s\n", names[k], secs * 1e3,
+        src.size / secs / 1e6, scalar_secs / secs,
+        sum == reference ? "tokens match" : "TOKENS DIFFER");
+    if (sum != reference) return 1;
+  }
+
+  source_close(&src);
+  return 0;
+}
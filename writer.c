@@ -27,7 +27,27 @@
 
 #include "writer.h"
 
-ssize_t write_program(char *outfile, uint32_t *text, uint32_t *data)
+/* Writes @word little endian */
+static size_t write_word(FILE *out, uint32_t word)
+{
+  uint8_t bytes[4] = {word, word >> 8, word >> 16, word >> 24};
+  return fwrite(bytes, 1, 4, out);
+}
+
+/* Writes the bytes of @segment, then zeros up to a whole word */
+static size_t write_segment(FILE *out, const struct segment *segment)
+{
+  static const uint8_t zeros[4];
+  size_t count = 0;
+
+  if (segment->len > 0)
+    count = fwrite(segment->bytes, 1, segment->len, out);
+  count += fwrite(zeros, 1, (4 - segment->len % 4) % 4, out);
+  return count;
+}
+
+ssize_t write_program(char *outfile, const struct segment *text,
+                      const struct segment *data)
 {
   size_t count;
   FILE *out;
@@ -35,19 +55,28 @@ ssize_t write_program(char *outfile, uint32_t *text, uint32_t *data)
   out = fopen(outfile, "w");
   if (out == NULL) return -1;
 
+  count = fwrite(PROGRAM_MAGIC, 1, 4, out);
+  count += write_word(out, data->base);
+  count += write_word(out, data->len);
+  count += write_word(out, text->base);
+  count += write_word(out, text->len);
+
 #ifdef DEBUG
   printf("Writing .data segment\n");
 #endif
-  
-  count = fwrite(data, sizeof(uint32_t), DATA_SEGMENT_WORDS, out);
+
+  count += write_segment(out, data);
 
 #ifdef DEBUG
   printf("Writing .text segment\n");
 #endif
 
-  count += fwrite(text, sizeof(uint32_t), TEXT_SEGMENT_WORDS, out);
+  count += write_segment(out, text);
 
-  fclose(out);
+  if (ferror(out)) {
+    fclose(out);
+    return -1;
+  }
+  if (fclose(out) != 0) return -1;
   return count;
 }
-
@@ -30,19 +30,33 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
-#define DATA_SEGMENT_WORDS (1024)
-#define TEXT_SEGMENT_WORDS (1024)
+/* The first word of a program file */
+#define PROGRAM_MAGIC "MXE2"
 
 /**
- * Writes to @outfile the program consisting of the 1024 32-bit data words in
- * the @data segment and 1024 32-bit instruction words in the @data segment.
+ * A segment of a program: where it is loaded, and its bytes.
+ */
+struct segment {
+  uint32_t base;
+  const uint8_t *bytes;
+  size_t len;
+};
+
+/**
+ * Writes to @outfile the program consisting of the @data and @text
+ * segments, only as many bytes as they hold.
  *
- * Returns the number of 32-bit words written (should be 2048).
+ * The file starts with PROGRAM_MAGIC and four 32-bit words: the base address
+ * and the length in bytes of the data segment, then those of the text
+ * segment. The data follows, then the text, each padded with zeros to a
+ * whole word. The words of the header are little endian, the segments are
+ * written as they are given.
  *
- * Note that the text and data are written out in big-endian order. If another
- * endianness is required, the caller must ensure to swap the byte order first.
+ * Returns the number of bytes written, or -1 on error.
  */
-ssize_t write_program(char *outfile, uint32_t *text, uint32_t *data);
+ssize_t write_program(char *outfile, const struct segment *text,
+                      const struct segment *data);
 
 #endif /* WRITER_H_ */